@@ -11,9 +11,10 @@
 
 namespace cpcl {
 
+struct MemoryStorage;
+class SharedBuffer;
+
 class DynamicMemoryStream : public IOStream {
-  struct MemoryStorage;
-  
   bool state;
   boost::shared_ptr<MemoryStorage> memory_storage;
 public:
@@ -26,6 +27,9 @@ public:
     p_size = p_offset = 0; state = true;
   }
 
+  /* written bytes become immutable SharedBuffer without copy, stream is empty after call */
+  SharedBuffer Freeze();
+
   explicit DynamicMemoryStream(size_t block_size = 0x1000);
   virtual ~DynamicMemoryStream();
 
@@ -0,0 +1,36 @@
+﻿// file_mapping.h
+#pragma once
+
+#ifndef __CPCL_FILE_MAPPING_H
+#define __CPCL_FILE_MAPPING_H
+
+#include <cpcl/basic.h>
+
+namespace cpcl {
+
+/*
+ * read-only view of whole file, unmapped in destructor
+ * file may be removed or renamed while mapped, view stays readable
+ * (on windows file opened with FILE_SHARE_DELETE, file and mapping handles closed right after MapViewOfFile)
+ */
+class FileMapping {
+  void *data;
+  size_t size;
+
+  FileMapping(void *data_, size_t size_);
+  DISALLOW_COPY_AND_ASSIGN(FileMapping);
+public:
+  ~FileMapping();
+
+  unsigned char const* Data() const { return static_cast<unsigned char const*>(data); }
+  size_t Size() const { return size; }
+  /* whole view will be read soon, read ahead if os supports it */
+  void WillNeed();
+
+  /* false if file is missing(not traced), empty or can't be mapped */
+  static bool Map(FilePathChar const *file_path, FileMapping **r);
+};
+
+} // namespace cpcl
+
+#endif // __CPCL_FILE_MAPPING_H
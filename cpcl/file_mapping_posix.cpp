@@ -0,0 +1,53 @@
+﻿#include "basic.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "file_mapping.h"
+#include "trace.h"
+
+namespace cpcl {
+
+FileMapping::FileMapping(void *data_, size_t size_) : data(data_), size(size_)
+{}
+FileMapping::~FileMapping() {
+  if (::munmap(data, size) == -1)
+    ErrorSystem(errno, "FileMapping::~FileMapping(): munmap fails: ");
+}
+
+void FileMapping::WillNeed() {
+  ::madvise(data, size, MADV_WILLNEED);
+}
+
+bool FileMapping::Map(char const *file_path, FileMapping **r) {
+  int const fd = ::open(file_path, O_RDONLY);
+  if (-1 == fd) {
+    if (errno != ENOENT)
+      ErrorSystem(errno, "FileMapping::Map('%s'): open fails: ", file_path);
+    return false;
+  }
+  struct stat info;
+  void *data = MAP_FAILED;
+  if (::fstat(fd, &info) == -1)
+    ErrorSystem(errno, "FileMapping::Map('%s'): fstat fails: ", file_path);
+  else if (info.st_size > 0)
+    data = ::mmap(0, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == data && info.st_size > 0)
+    ErrorSystem(errno, "FileMapping::Map('%s'): mmap fails: ", file_path);
+  ::close(fd); // mapping keeps file
+  if (MAP_FAILED == data)
+    return false;
+
+  FileMapping *v = new FileMapping(data, static_cast<size_t>(info.st_size));
+  if (r)
+    *r = v;
+  else
+    delete v;
+  return true;
+}
+
+} // namespace cpcl
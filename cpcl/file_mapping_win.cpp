@@ -0,0 +1,59 @@
+﻿#include "basic.h"
+
+#include "file_mapping.h"
+#include "string_util.h"
+#include "trace.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+namespace cpcl {
+
+FileMapping::FileMapping(void *data_, size_t size_) : data(data_), size(size_)
+{}
+FileMapping::~FileMapping() {
+  if (::UnmapViewOfFile(data) == FALSE)
+    ErrorSystem(::GetLastError(), "FileMapping::~FileMapping(): UnmapViewOfFile fails:");
+}
+
+void FileMapping::WillNeed()
+{} // PrefetchVirtualMemory is not available before windows 8
+
+bool FileMapping::Map(wchar_t const *file_path, FileMapping **r) {
+  HANDLE hFile = ::CreateFileW(file_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+    NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) {
+    unsigned long const error_code = ::GetLastError();
+    if (error_code != ERROR_FILE_NOT_FOUND && error_code != ERROR_PATH_NOT_FOUND)
+      ErrorSystem(error_code, "FileMapping::Map('%s'): CreateFileW fails:", ConvertUTF16_CP1251(file_path).c_str());
+    return false;
+  }
+  LARGE_INTEGER file_size;
+  HANDLE hMapping = NULL;
+  if (::GetFileSizeEx(hFile, &file_size) == FALSE) {
+    ErrorSystem(::GetLastError(), "FileMapping::Map('%s'): GetFileSizeEx fails:", ConvertUTF16_CP1251(file_path).c_str());
+  } else if (file_size.QuadPart > 0 && (unsigned long long)file_size.QuadPart <= (size_t)-1) {
+    hMapping = ::CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!hMapping)
+      ErrorSystem(::GetLastError(), "FileMapping::Map('%s'): CreateFileMappingW fails:", ConvertUTF16_CP1251(file_path).c_str());
+  }
+  ::CloseHandle(hFile); // mapping keeps file
+  if (!hMapping)
+    return false;
+  void *data = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+  if (!data)
+    ErrorSystem(::GetLastError(), "FileMapping::Map('%s'): MapViewOfFile fails:", ConvertUTF16_CP1251(file_path).c_str());
+  ::CloseHandle(hMapping); // view keeps mapping
+  if (!data)
+    return false;
+
+  FileMapping *v = new FileMapping(data, (size_t)file_size.QuadPart);
+  if (r)
+    *r = v;
+  else
+    delete v;
+  return true;
+}
+
+} // namespace cpcl
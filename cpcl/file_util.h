@@ -84,6 +84,18 @@ inline bool DeleteFilePath(std::basic_string<FilePathChar> const &file_path) {
   return DeleteFilePath(file_path.c_str());
 }
 
+/* single attempt, unlike DeleteFilePath doesn't wait and retry, missing file is not an error */
+bool RemoveFilePath(FilePathChar const *file_path);
+
+/* creates directory if it doesn't exist, parent directory must exist */
+bool CreateDirectoryPath(FilePathChar const *dir_path);
+
+/* existing new_path replaced, so readers of new_path see either old or new file */
+bool RenameFilePath(FilePathChar const *old_path, FilePathChar const *new_path);
+
+/* size in bytes && last modification time in seconds since epoch */
+bool GetFileSizeAndTime(FilePathChar const *file_path, uint64 *size, int64 *modification_time);
+
 /* bool GetPathComponents(WStringPiece const &path,
   std::wstring *basename, std::wstring *name, std::wstring *ext);
 template<class CharType>
@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stdio.h> // rename
 #include <limits.h> // PATH_MAX
 #include <cstdlib> // getenv
 #include <errno.h>
@@ -74,4 +75,41 @@ bool DeleteFilePath(char const *file_path) {
   return true;
 }
 
+bool RemoveFilePath(char const *file_path) {
+  if (::unlink(file_path) == -1 && errno != ENOENT) {
+    ErrorSystem(errno, "RemoveFilePath(): unlink('%s') fails: ", file_path);
+    return false;
+  }
+  return true;
+}
+
+bool CreateDirectoryPath(char const *dir_path) {
+  if (::mkdir(dir_path, 0755) == -1 && errno != EEXIST) {
+    ErrorSystem(errno, "CreateDirectoryPath(): mkdir('%s') fails: ", dir_path);
+    return false;
+  }
+  return true;
+}
+
+bool RenameFilePath(char const *old_path, char const *new_path) {
+  if (::rename(old_path, new_path) == -1) {
+    ErrorSystem(errno, "RenameFilePath(): rename('%s', '%s') fails: ", old_path, new_path);
+    return false;
+  }
+  return true;
+}
+
+bool GetFileSizeAndTime(char const *file_path, uint64 *size, int64 *modification_time) {
+  struct stat info;
+  if (::stat(file_path, &info) == -1) {
+    ErrorSystem(errno, "GetFileSizeAndTime(): stat('%s') fails: ", file_path);
+    return false;
+  }
+  if (size)
+    *size = static_cast<uint64>(info.st_size);
+  if (modification_time)
+    *modification_time = static_cast<int64>(info.st_mtime);
+  return true;
+}
+
 } // namespace cpcl
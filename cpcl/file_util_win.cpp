@@ -231,6 +231,53 @@ bool DeleteFilePath(wchar_t/*WStringPiece const&*/ const *file_path) {
   return false;
 }
 
+bool RemoveFilePath(wchar_t const *file_path) {
+  if (::DeleteFileW(file_path) == FALSE) {
+    unsigned long const error_code = ::GetLastError();
+    if (error_code != ERROR_FILE_NOT_FOUND && error_code != ERROR_PATH_NOT_FOUND) {
+      ErrorSystem(error_code, "RemoveFilePath('%s'): DeleteFileW fails:", ConvertUTF16_CP1251(file_path).c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CreateDirectoryPath(wchar_t const *dir_path) {
+  if (::CreateDirectoryW(dir_path, NULL) == FALSE) {
+    unsigned long const error_code = ::GetLastError();
+    if (error_code != ERROR_ALREADY_EXISTS) {
+      ErrorSystem(error_code, "CreateDirectoryPath('%s'): CreateDirectoryW fails:", ConvertUTF16_CP1251(dir_path).c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RenameFilePath(wchar_t const *old_path, wchar_t const *new_path) {
+  if (::MoveFileExW(old_path, new_path, MOVEFILE_REPLACE_EXISTING) == FALSE) {
+    ErrorSystem(::GetLastError(), "RenameFilePath('%s', '%s'): MoveFileExW fails:",
+      ConvertUTF16_CP1251(old_path).c_str(), ConvertUTF16_CP1251(new_path).c_str());
+    return false;
+  }
+  return true;
+}
+
+bool GetFileSizeAndTime(wchar_t const *file_path, uint64 *size, int64 *modification_time) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (::GetFileAttributesExW(file_path, GetFileExInfoStandard, &data) == FALSE) {
+    ErrorSystem(::GetLastError(), "GetFileSizeAndTime('%s'): GetFileAttributesExW fails:", ConvertUTF16_CP1251(file_path).c_str());
+    return false;
+  }
+  if (size)
+    *size = ((uint64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+  if (modification_time) {
+    // FILETIME - 100 nanosecond intervals since 1601-01-01
+    uint64 const t = ((uint64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    *modification_time = (int64)((t - 116444736000000000ULL) / 10000000);
+  }
+  return true;
+}
+
 #if 0
 
 size_t AvailableDiskSpaceMib(WStringPiece const &path) {
@@ -0,0 +1,100 @@
+﻿// memory_storage.h - list of fixed size memory blocks, storage for DynamicMemoryStream && SharedBuffer
+#pragma once
+
+#ifndef __CPCL_MEMORY_STORAGE_H
+#define __CPCL_MEMORY_STORAGE_H
+
+#include <string.h> // memcpy
+#include <algorithm> // std::min
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include <cpcl/basic.h>
+
+namespace cpcl {
+
+struct MemoryStorage {
+  size_t Read(size_t offset, unsigned char *data, size_t size) const {
+    size_t readed(0), pad(offset % N);
+    for (BlocksConstIt it = Block(offset), tail = blocks.end(); it != tail; ++it) {
+      size_t const n = std::min(N - pad, size);
+      memcpy(data + readed, *it + pad, n);
+      readed += n;
+      size -= n;
+      if (!size)
+        break;
+      pad = 0;
+    }
+    return readed;
+  }
+  size_t Write(size_t offset, unsigned char const *data, size_t size) {
+    if (blocks.size() * N == offset) {
+      unsigned char *block = new unsigned char[N];
+      blocks.push_back(block);
+    }
+    size_t written(0), pad(offset % N);
+    for (BlocksIt it = Block(offset), tail = blocks.end(); it != tail; ++it) {
+      size_t const n = std::min(N - pad, size);
+      memcpy(*it + pad, data + written, n);
+      written += n;
+      size -= n;
+      if (!size)
+        break;
+      pad = 0;
+    }
+    if (!written && !!size) // offset after EOF
+      return 0;
+    while (!!size) {
+      unsigned char *block = new unsigned char[N];
+      blocks.push_back(block);
+      size_t const n = std::min(N, size);
+      memcpy(block, data + written, n);
+      written += n;
+      size -= n;
+    }
+    return written;
+  }
+
+  MemoryStorage(size_t N = 4 * 1024) : N(N)
+  {}
+  /* one block of memory not allocated by storage(i.e. mapped file), owner releases it, Write not allowed */
+  MemoryStorage(unsigned char *data, size_t size, boost::shared_ptr<void> const &owner) : N(size), owner(owner) {
+    blocks.push_back(data);
+  }
+  ~MemoryStorage() {
+    if (!owner) {
+      for (BlocksIt it = blocks.begin(), tail = blocks.end(); it != tail; ++it)
+        delete [] *it;
+    }
+    blocks.clear();
+  }
+// private:
+  typedef std::vector<unsigned char*> Blocks;
+  typedef Blocks::iterator BlocksIt;
+  typedef Blocks::const_iterator BlocksConstIt;
+  size_t const N;
+  Blocks blocks;
+  boost::shared_ptr<void> owner;
+
+  BlocksIt Block(size_t offset) {
+    size_t const idx = offset / N;
+    if (idx < blocks.size())
+      return blocks.begin() + idx;
+    else
+      return blocks.end();
+  }
+  BlocksConstIt Block(size_t offset) const {
+    size_t const idx = offset / N;
+    if (idx < blocks.size())
+      return blocks.begin() + idx;
+    else
+      return blocks.end();
+  }
+private:
+  DISALLOW_COPY_AND_ASSIGN(MemoryStorage);
+};
+
+} // namespace cpcl
+
+#endif // __CPCL_MEMORY_STORAGE_H
@@ -0,0 +1,109 @@
+﻿#include "basic.h"
+
+#include <stdio.h> // SEEK_SET SEEK_CUR SEEK_END
+#include <algorithm> // std::min
+
+#include "shared_buffer.h"
+#include "memory_storage.h"
+#include "trace.h"
+
+namespace cpcl {
+
+SharedBuffer::SharedBuffer(boost::shared_ptr<MemoryStorage const> storage, size_t size)
+  : storage(storage), size(size)
+{}
+
+size_t SharedBuffer::Read(size_t offset, void *data, size_t n) const {
+  if (!storage || offset >= size)
+    return 0;
+  return storage->Read(offset, static_cast<unsigned char*>(data), std::min(n, size - offset));
+}
+
+std::pair<unsigned char const*, size_t> SharedBuffer::Block(size_t offset) const {
+  if (!storage || offset >= size)
+    return std::pair<unsigned char const*, size_t>(static_cast<unsigned char const*>(0), 0);
+  size_t const pad = offset % storage->N;
+  size_t const n = std::min(storage->N - pad, size - offset);
+  return std::pair<unsigned char const*, size_t>(*storage->Block(offset) + pad, n);
+}
+
+SharedBufferStream::SharedBufferStream() : p_offset(0), state(true)
+{}
+SharedBufferStream::SharedBufferStream(SharedBuffer const &buffer) : buffer(buffer), p_offset(0), state(true)
+{}
+SharedBufferStream::~SharedBufferStream()
+{}
+
+void SharedBufferStream::Assign(SharedBuffer const &v) {
+  buffer = v;
+  p_offset = 0;
+  state = true;
+}
+
+IOStream* SharedBufferStream::Clone() {
+  return new SharedBufferStream(*this);
+}
+
+uint32 SharedBufferStream::CopyTo(IOStream *output, uint32 size) {
+  uint32 written(0);
+  while (size > 0) {
+    std::pair<unsigned char const*, size_t> block = buffer.Block(p_offset);
+    if (!block.second)
+      break;
+    uint32 const n = (uint32)std::min(block.second, (size_t)size);
+    uint32 const written_ = output->Write(block.first, n);
+    written += written_;
+    p_offset += written_;
+    if (written_ != n)
+      break;
+    size -= n;
+  }
+  return written;
+}
+
+uint32 SharedBufferStream::Read(void *data, uint32 size) {
+  size_t r = buffer.Read(p_offset, data, size);
+  p_offset += r;
+  state = true;
+  return (uint32)r;
+}
+
+uint32 SharedBufferStream::Write(void const*, uint32) {
+  Warning(StringPieceFromLiteral("SharedBufferStream::Write(): stream is read-only"));
+  state = false;
+  return 0;
+}
+
+bool SharedBufferStream::Seek(int64 move_to, uint32 move_method, int64 *position) {
+  if (SEEK_CUR == move_method)
+    move_to = (int64)p_offset + move_to;
+  else if (SEEK_END == move_method)
+    move_to = (int64)buffer.Size() + move_to;
+  else if (SEEK_SET != move_method) {
+    Error(StringPieceFromLiteral("SharedBufferStream::Seek(): invalid move_method"));
+    return false;
+  }
+
+  if (move_to < 0) {
+    Error(StringPieceFromLiteral("SharedBufferStream::Seek(): move_to before the beginning of the buffer"));
+    return false;
+  }
+  else if (move_to > (int64)buffer.Size()) {
+    Error(StringPieceFromLiteral("SharedBufferStream::Seek(): move_to beyond the buffer"));
+    return false;
+  }
+  p_offset = (size_t)move_to;
+  if (position)
+    *position = (int64)p_offset;
+  return true;
+}
+
+int64 SharedBufferStream::Tell() {
+  return (int64)p_offset;
+}
+
+int64 SharedBufferStream::Size() {
+  return (int64)buffer.Size();
+}
+
+} // namespace cpcl
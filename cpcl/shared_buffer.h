@@ -0,0 +1,68 @@
+﻿// shared_buffer.h - immutable refcounted byte buffer && stream with own seek pointer over it
+#pragma once
+
+#ifndef __CPCL_SHARED_BUFFER_H
+#define __CPCL_SHARED_BUFFER_H
+
+#include <stddef.h>
+#include <utility> // std::pair
+
+#include <boost/shared_ptr.hpp>
+
+#include <cpcl/io_stream.h>
+
+namespace cpcl {
+
+struct MemoryStorage;
+
+/*
+ * SharedBuffer never changes after construction, so any number of threads may read it without locking
+ * copy of SharedBuffer only increments reference count of the storage
+ */
+class SharedBuffer {
+  boost::shared_ptr<MemoryStorage const> storage;
+  size_t size;
+public:
+  SharedBuffer() : size(0)
+  {}
+  SharedBuffer(boost::shared_ptr<MemoryStorage const> storage, size_t size);
+
+  bool operator!() const { return !storage; }
+  size_t Size() const { return size; }
+
+  /* return number of bytes copied to data, i.e. min(size, Size() - offset) */
+  size_t Read(size_t offset, void *data, size_t size) const;
+  /* contiguous bytes starting at offset, up to the end of the memory block that contains offset */
+  std::pair<unsigned char const*, size_t> Block(size_t offset) const;
+};
+
+/*
+ * read-only IOStream over SharedBuffer, every reader keeps own seek pointer
+ * Write always fails
+ */
+class SharedBufferStream : public IOStream {
+  SharedBuffer buffer;
+  size_t p_offset;
+  bool state;
+public:
+  SharedBufferStream();
+  explicit SharedBufferStream(SharedBuffer const &buffer);
+  virtual ~SharedBufferStream();
+
+  /* attach reader to another buffer, seek pointer moves to the beginning */
+  void Assign(SharedBuffer const &v);
+  SharedBuffer const& Buffer() const { return buffer; }
+
+  virtual bool operator!() const { return !state; }
+  virtual IOStream* Clone();
+  virtual uint32 CopyTo(IOStream *output, uint32 size);
+  virtual uint32 Read(void *data, uint32 size);
+  virtual uint32 Write(void const *data, uint32 size);
+  virtual bool Seek(int64 move_to, uint32 move_method, int64 *position);
+  virtual int64 Tell();
+  virtual int64 Size();
+};
+
+} // namespace cpcl
+
+#endif // __CPCL_SHARED_BUFFER_H
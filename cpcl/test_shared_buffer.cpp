@@ -0,0 +1,70 @@
+﻿#include "basic.h"
+
+#include <stdio.h> // SEEK_SET SEEK_END
+#include <string.h> // memcmp
+
+#include <cassert>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "dynamic_memory_stream.h"
+#include "shared_buffer.h"
+
+using namespace cpcl;
+
+static std::vector<unsigned char> MakeData(size_t size) {
+  std::vector<unsigned char> r(size);
+  for (size_t i = 0; i < size; ++i)
+    r[i] = (unsigned char)(i * 31 + (i >> 8));
+  return r;
+}
+
+static void ReadAll(SharedBuffer buffer, std::vector<unsigned char> const *data, bool *result) {
+  SharedBufferStream reader(buffer);
+  std::vector<unsigned char> r(data->size());
+  size_t offset(0);
+  for (uint32 n; (n = reader.Read(&r[offset], (uint32)(std::min)((size_t)0x333, r.size() - offset))) > 0;)
+    offset += n;
+  *result = (offset == data->size()) && (0 == memcmp(&r[0], &(*data)[0], r.size()));
+}
+
+void test_shared_buffer() {
+  std::vector<unsigned char> data = MakeData(0x2345);
+  DynamicMemoryStream stream(0x1000);
+  stream.Write(&data[0], (uint32)data.size());
+
+  SharedBuffer buffer = stream.Freeze();
+  assert(0 == stream.Size()); // storage moved to buffer
+  assert(data.size() == buffer.Size());
+
+  { // blocks cover buffer
+    size_t offset(0);
+    for (std::pair<unsigned char const*, size_t> block; (block = buffer.Block(offset)).second > 0; offset += block.second)
+      assert(0 == memcmp(block.first, &data[offset], block.second));
+    assert(data.size() == offset);
+    assert(0x1000 - 0x10 == buffer.Block(0x10).second);
+  }
+  { // readers have own seek pointers
+    SharedBufferStream a(buffer), b(buffer);
+    unsigned char x[0x10], y[0x10];
+    assert(a.Seek(0x1FF8, SEEK_SET, NULL));
+    assert(sizeof(x) == a.Read(x, sizeof(x)));
+    assert(sizeof(y) == b.Read(y, sizeof(y)));
+    assert(0 == memcmp(x, &data[0x1FF8], sizeof(x)));
+    assert(0 == memcmp(y, &data[0], sizeof(y)));
+    assert(0x2008 == a.Tell() && 0x10 == b.Tell());
+    assert(!a.Seek(1, SEEK_END, NULL));
+    assert(0 == a.Write(x, sizeof(x)));
+  }
+  { // concurrent readers
+    bool results[8];
+    boost::thread_group threads;
+    for (size_t i = 0; i < arraysize(results); ++i)
+      threads.create_thread(boost::bind(&ReadAll, buffer, &data, results + i));
+    threads.join_all();
+    for (size_t i = 0; i < arraysize(results); ++i)
+      assert(results[i]);
+  }
+}
@@ -0,0 +1,51 @@
+﻿// cancel_token.h
+#pragma once
+
+#ifndef __CANCEL_TOKEN_H
+#define __CANCEL_TOKEN_H
+
+#include <exception>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+/*
+ * cancellation flag shared by copies, set by connection when client goes away or request deadline passed,
+ * polled by render worker before task started and by rendering device between scanlines
+ * token with deadline cancels itself once deadline passed, even before connection notices it
+ */
+class CancelToken {
+  boost::shared_ptr<boost::atomic<bool> > cancelled;
+  boost::posix_time::ptime deadline; // not_a_date_time - no deadline
+public:
+  CancelToken() : cancelled(new boost::atomic<bool>(false))
+  {}
+  explicit CancelToken(boost::posix_time::ptime const &deadline) : cancelled(new boost::atomic<bool>(false)), deadline(deadline)
+  {}
+
+  void Cancel() { cancelled->store(true, boost::memory_order_relaxed); }
+  bool Cancelled() const { return cancelled->load(boost::memory_order_relaxed) || Expired(); }
+  bool Expired() const {
+    return !deadline.is_not_a_date_time() && boost::posix_time::microsec_clock::universal_time() >= deadline;
+  }
+  boost::posix_time::ptime Deadline() const { return deadline; }
+
+  /* copies of the same token */
+  bool operator==(CancelToken const &r) const { return cancelled == r.cancelled; }
+  bool operator!=(CancelToken const &r) const { return cancelled != r.cancelled; }
+};
+
+// thrown from rendering device to unwind plugin render loop
+class cancelled_exception : public std::exception {
+public:
+#if defined(_MSC_VER)
+  virtual char const* what() const {
+#else
+  virtual char const* what() const throw() {
+#endif
+    return "render cancelled";
+  }
+};
+
+#endif // __CANCEL_TOKEN_H
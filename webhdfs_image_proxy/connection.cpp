@@ -3,10 +3,13 @@
 #include <string.h> // memcpy
 
 #include <algorithm>
+#include <vector>
 
 #include "connection.h"
+#include "image_header.h"
 #include <boost/make_shared.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <cpcl/string_util.hpp>
 #include <cpcl/split_iterator.hpp>
@@ -45,33 +48,632 @@ static inline void WriteHeader(char *&buf, size_t &buf_len, StringPiece const &n
   StringAdvance(buf, buf_len, StringPieceFromLiteral("\r\n"));
 }
 
+/*
+ * single range of "Range: bytes=first-last", "bytes=first-" or "bytes=-suffix" over size bytes
+ * returns 206 and [*first, *first + *len), 416 if range starts past the end,
+ * 200 for malformed or multiple ranges, whole body sent then
+ */
+static int ByteRange(StringPiece const &range, size_t size, size_t *first, size_t *len) {
+  StringPiece const unit = StringPieceFromLiteral("bytes=");
+  if (!range.starts_with(unit))
+    return 200;
+  StringPiece const spec(range.data() + unit.size(), range.size() - unit.size());
+  char const *dash = std::find(spec.begin(), spec.end(), '-');
+  if (spec.end() == dash || std::find(spec.begin(), spec.end(), ',') != spec.end())
+    return 200;
+  StringPiece const a(spec.begin(), dash - spec.begin()), b(dash + 1, spec.end() - (dash + 1));
+  unsigned long x(0), y(0);
+  if ((!a.empty() && !TryConvert(a, &x)) || (!b.empty() && !TryConvert(b, &y)) || (a.empty() && b.empty()))
+    return 200;
+
+  if (a.empty()) { // suffix
+    if (!y)
+      return 416;
+    x = (y < size) ? size - y : 0;
+    y = size - 1;
+  } else {
+    if (x >= size)
+      return 416;
+    if (!b.empty() && y < x)
+      return 200;
+    if (b.empty() || y >= size)
+      y = size - 1;
+  }
+  *first = x;
+  *len = y - x + 1;
+  return 206;
+}
+
+static inline void CloseSocket(ip::tcp::socket &socket) {
+  boost::system::error_code ignored_ec;
+  socket.shutdown(ip::tcp::socket::shutdown_both, ignored_ec);
+  ignored_ec = boost::system::error_code();
+  socket.close(ignored_ec);
+}
+
 // state chart:
 // Start
 //  |
-// handle_read_request -loop- until eof || headers_complete
-//  |            |
-// SendRequest SendResponse(400)
-// ...
+// ReadRequest <------------------------------------------------------+
+//  |                                                                  |
+// handle_read_request -loop- until eof || message_complete            |
+//  |            |                                                     |
+// SendRequest SendResponse(400)                                       |
+// ...                                                                 |
+// handle_write_response -> FinishResponse -keep-alive, next request---+
 
 namespace net {
 
-Connection::Connection(boost::asio::io_service &io_service, boost::shared_ptr<ImageCache> image_cache, boost::shared_ptr<TaskPool> task_pool,
+Connection::Connection(boost::asio::io_service &io_service, boost::shared_ptr<ProxyContext> context,
   std::string host, std::string port, plcl::PluginList *plugin_list)
-  : client_socket(io_service), webhdfs_socket(io_service), resolver(io_service), host(host), port(port),
-  parser(true), status_code(-1), image_cache(image_cache), task_pool(task_pool), plugin_list(plugin_list),
-  page_width(0), page_height(0), page_pixfmt(PLCL_PIXEL_FORMAT_INVALID) {
+  : io_service(io_service), strand(io_service), client_socket(io_service), idle_timer(io_service),
+  waiting_request(false), keep_alive(false), requests_count(0), reading(false), processing(false), client_eof(false), closing(false),
+  request_timer(io_service), responding(false),
+  webhdfs_reused(false), webhdfs_received(0), namenode_host(host), namenode_port(port), host(host), port(port), location_cached(false), probe_length(0), probed(false), stat_request(false), stat_leader(false), status_stale(false), revalidating(false),
+  request_parser(true), request_head(0), request_tail(0), request_received(0),
+  parser(false), original_hit(false), stream_writing(false), stream_eof(false), stream_code(-1), body_hit(false), fetch_leader(false), render_leader(false), status_code(-1), context(context), plugin_list(plugin_list) {
   Trace(CPCL_TRACE_LEVEL_DEBUG, "Connection::Connection(%08X)", (int)this);
 }
 Connection::~Connection() {
+  // connection failed before result, release waiters
+  CompleteFetch(502);
+  CompleteRender(502);
+  CompleteStat(502, SharedBuffer());
   Trace(CPCL_TRACE_LEVEL_DEBUG, "Connection::~Connection(%08X)", (int)this);
 }
 
 void Connection::Start() {
-  parser.content = boost::static_pointer_cast<IOStream>(boost::make_shared<DynamicMemoryStream>());
-  client_socket.async_read_some(boost::asio::buffer(buffer),
-    boost::bind(&Connection::handle_read_request, shared_from_this(),
+  request_body = boost::make_shared<DynamicMemoryStream>();
+  request_parser.content = request_body;
+  request_parser.pause_on_message_complete = true;
+  ReadRequest();
+}
+
+void Connection::ReadRequest() {
+  if (!waiting_request) {
+    waiting_request = true;
+    idle_timer.expires_from_now(boost::posix_time::seconds(context->options.client_idle_timeout));
+    idle_timer.async_wait(strand.wrap(
+      boost::bind(&Connection::handle_idle_timeout, shared_from_this(),
+      boost::asio::placeholders::error)));
+  }
+  ReadClient();
+}
+
+/*
+ * at most one read on client_socket, bytes appended to request_buffer[request_tail, size)
+ * while request processed the read watches client: error cancels render, eof is half-close, response still sent,
+ * data is next pipelined request, kept until response sent
+ */
+void Connection::ReadClient() {
+  if (reading || client_eof)
+    return;
+  if (request_head > 0) {
+    ::memmove(request_buffer.data(), request_buffer.data() + request_head, request_tail - request_head);
+    request_tail -= request_head;
+    request_head = 0;
+  }
+  if (request_tail == request_buffer.size())
+    return; // pipelined requests fill buffer, wait until they parsed
+  reading = true;
+  client_socket.async_read_some(boost::asio::buffer(request_buffer.data() + request_tail, request_buffer.size() - request_tail),
+    strand.wrap(boost::bind(&Connection::handle_read_request, shared_from_this(),
     boost::asio::placeholders::error,
-    boost::asio::placeholders::bytes_transferred));
+    boost::asio::placeholders::bytes_transferred)));
+}
+
+/* client gone, render result not needed, unless other connections wait for it */
+void Connection::CancelRender() {
+  client_eof = true;
+  if (stream)
+    stream->Close(); // worker doesn't wait for client any more
+  if (render_leader && context->renders->WaitersCount(render_key) > 0)
+    return;
+  cancel_token.Cancel();
+}
+
+void Connection::StopWaiting() {
+  if (waiting_request) {
+    waiting_request = false;
+    boost::system::error_code ignored_ec;
+    idle_timer.cancel(ignored_ec);
+  }
+}
+
+void Connection::handle_idle_timeout(boost::system::error_code const &ec) {
+  // timer may expire right before StopWaiting, so check deadline
+  if (!ec && waiting_request && idle_timer.expires_at() <= boost::asio::deadline_timer::traits_type::now()) {
+    Trace(CPCL_TRACE_LEVEL_DEBUG,
+      "Connection(%08X)::handle_idle_timeout(): no request in %u seconds, %u requests served",
+      (int)this, context->options.client_idle_timeout, requests_count);
+    waiting_request = false;
+    boost::system::error_code ignored_ec;
+    client_socket.close(ignored_ec); // abort pending read
+  }
+}
+
+/* request deadline from options.request_timeout, query timeout may only shorten it */
+void Connection::StartDeadline() {
+  unsigned int timeout = context->options.request_timeout;
+  if (query.timeout > 0 && (!timeout || query.timeout < timeout))
+    timeout = query.timeout;
+  if (!timeout)
+    return;
+  cancel_token = CancelToken(boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(timeout));
+  request_timer.expires_at(cancel_token.Deadline());
+  request_timer.async_wait(strand.wrap(
+    boost::bind(&Connection::handle_request_timeout, shared_from_this(),
+    boost::asio::placeholders::error)));
+}
+
+/*
+ * deadline passed before render finished: abort webhdfs exchange and render,
+ * answer 504, or truncate stream if its headers already sent
+ */
+void Connection::handle_request_timeout(boost::system::error_code const &ec) {
+  // timer may expire right before SendResponse or CompleteStream cancels it, or belong to previous request
+  if (!!ec || !processing || request_timer.expires_at() > boost::asio::deadline_timer::traits_type::now())
+    return;
+  bool const streaming = !!stream && stream_code < 0;
+  if (responding && !streaming)
+    return;
+  Trace(CPCL_TRACE_LEVEL_WARNING,
+    "Connection(%08X)::handle_request_timeout(): \"%s\" not served before deadline",
+    (int)this, webhdfs_path.c_str());
+  cancel_token.Cancel(); // render worker stops before next scanline
+  if (webhdfs_socket) {
+    CloseSocket(*webhdfs_socket); // pending webhdfs operation completes with operation_aborted
+    webhdfs_socket.reset();
+  }
+  CompleteFetch(504);
+  if (responding) {
+    AbortStream();
+  } else {
+    if (stream) {
+      stream->Close();
+      stream.reset();
+    }
+    SendResponse(504);
+  }
+}
+
+/* parse request_buffer[request_head, request_tail), parser pauses after message, rest of buffer is next pipelined request */
+void Connection::ParseRequest(bool eof) {
+  bool invalid_request(false);
+  if (request_head < request_tail) {
+    size_t parsed(0);
+    invalid_request = !request_parser.Parse(reinterpret_cast<char const*>(request_buffer.data()) + request_head, request_tail - request_head, &parsed);
+    request_head += parsed;
+    request_received += parsed;
+  }
+  if (!invalid_request && eof && !request_parser.message_complete) {
+    if (!request_received) {
+      // client closed keep-alive connection between requests
+      StopWaiting();
+      return;
+    }
+    invalid_request = true;
+  }
+
+  if (invalid_request) {
+    StopWaiting();
+    keep_alive = false;
+    request_head = request_tail = 0;
+    SendResponse(400);
+  } else if (request_parser.message_complete) {
+    StopWaiting();
+    HandleRequest();
+  } else {
+    ReadRequest();
+  }
+}
+
+void Connection::HandleRequest() {
+  processing = true;
+  ReadClient(); // watch for eof
+
+  unsigned int const max_requests = context->options.client_max_requests;
+  keep_alive = request_parser.ShouldKeepAlive() && (!max_requests || requests_count + 1 < max_requests);
+
+  query = GetQuery(request_parser.url);
+  StartDeadline();
+  if (request_parser.HttpMethod() != HTTP_GET || query.request_path.size() < 2) {
+    SendResponse(400);
+  } else if (query.request_path == StringPieceFromLiteral("/_admin/prewarm")) {
+    HandlePrewarm();
+  } else {
+    webhdfs_path.assign(query.request_path.data(), query.request_path.size());
+    bool fresh(true);
+    if (context->options.status_ttl > 0 && !context->statuses->GetStale(webhdfs_path, &file_status, &fresh)) {
+      StatFile();
+    } else {
+      status_stale = !fresh; // cache tiers answer from expired status, no GETFILESTATUS round trip before response
+      LookupRender();
+    }
+  }
+}
+
+/* loopback clients only: "file=<csv>" starts prewarm, response - prewarm progress and cache footprint json */
+void Connection::HandlePrewarm() {
+  boost::system::error_code ec;
+  boost::asio::ip::tcp::endpoint const remote = client_socket.remote_endpoint(ec);
+  if (!!ec || !remote.address().is_loopback()) {
+    SendResponse(404);
+    return;
+  }
+  std::string const &uri = request_parser.url;
+  size_t const q = uri.find('?');
+  if (q != std::string::npos) {
+    for (StringSplitIterator it(StringPiece(uri).substr(q + 1), '&'), tail; it != tail; ++it) {
+      std::pair<StringPiece, StringPiece> key_value = SplitPair(*it, '=');
+      if (key_value.first == StringPieceFromLiteral("file") && !key_value.second.empty()) {
+        int const code = context->prewarmer->Start(key_value.second.as_string());
+        if (code != 202) {
+          SendResponse(code); // 503 - prewarm already running, 404 - file can't be opened
+          return;
+        }
+      }
+    }
+  }
+  DynamicMemoryStream report;
+  context->prewarmer->Report(&report);
+  body = report.Freeze();
+  body_hit = true; // not cached
+  query.json = true;
+  SendResponse(200);
+}
+
+/* validators known(or disabled, or expired): answer 304, cached render, or join render flight after status refreshed */
+void Connection::LookupRender() {
+  SetValidators();
+  if (NotModified()) {
+    SendResponse(304); // no fetch, decode or encode
+    return;
+  }
+
+  ImageHeader header;
+  if (query.json && context->metadata->Get(MetadataCache::KeyOf(webhdfs_path, version), &header)) {
+    DynamicMemoryStream info;
+    WriteImageInfo(header, &info);
+    body = info.Freeze();
+    body_hit = true; // cheaper to rebuild than to keep in render_cache
+    SendResponse(200); // no fetch or decode
+    return;
+  }
+
+  render_key = RenderKey(webhdfs_path, query) + version;
+  ImageCache::ItemHit r = context->render_cache->Get(render_key);
+  if (r.second) {
+    body = r.first;
+    body_hit = true;
+    SendResponse(200);
+  } else if (!context->disk_cache->AsyncGet("render:" + render_key,
+    boost::bind(&Connection::PostDiskRender, shared_from_this(), requests_count, _1))) {
+    JoinRender();
+  } // else wait for handle_disk_render
+}
+
+/* render not cached: refresh expired status first, then lead or join render flight */
+void Connection::JoinRender() {
+  if (status_stale) {
+    StatFile(); // render misses, fetched file must not be cached under expired version
+  } else if (context->renders->Join(render_key, boost::bind(&Connection::PostRenderFlight, shared_from_this(), requests_count, _1, _2))) {
+    render_leader = true;
+    SendRequest(webhdfs_path);
+  } // else wait for handle_render_flight
+}
+
+static inline unsigned int Fnv1a(StringPiece const &s) {
+  unsigned int h(2166136261U);
+  for (char const *it = s.begin(); it != s.end(); ++it)
+    h = (h ^ (unsigned char)*it) * 16777619U;
+  return h;
+}
+
+static char const *week_days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static char const *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static inline bool Digits(StringPiece const &s, unsigned int *v) {
+  unsigned int r(0);
+  for (char const *it = s.begin(); it != s.end(); ++it) {
+    if (*it < '0' || *it > '9')
+      return false;
+    r = r * 10 + (*it - '0');
+  }
+  *v = r;
+  return !s.empty();
+}
+
+/* IMF-fixdate "Sun, 06 Nov 1994 08:49:37 GMT" as seconds since epoch, obsolete rfc850 and asctime forms not accepted */
+static bool ParseHttpDate(StringPiece const &s, cpcl::int64 *v) {
+  if (s.size() != 29 || s[3] != ',' || s[4] != ' ' || s[7] != ' ' || s[11] != ' ' || s[16] != ' '
+    || s[19] != ':' || s[22] != ':' || !s.ends_with(StringPieceFromLiteral(" GMT")))
+    return false;
+  unsigned int day, year, hours, minutes, seconds;
+  if (!Digits(s.substr(5, 2), &day) || !Digits(s.substr(12, 4), &year)
+    || !Digits(s.substr(17, 2), &hours) || !Digits(s.substr(20, 2), &minutes) || !Digits(s.substr(23, 2), &seconds))
+    return false;
+  unsigned short month(0);
+  while (month < arraysize(months) && s.substr(8, 3) != StringPiece(months[month]))
+    ++month;
+  if (month == arraysize(months) || year < 1970 || year > 9999 || hours > 23 || minutes > 59 || seconds > 60
+    || !day || day > boost::gregorian::gregorian_calendar::end_of_month_day((unsigned short)year, month + 1))
+    return false;
+  boost::gregorian::date const d((unsigned short)year, month + 1, (unsigned short)day);
+  *v = (cpcl::int64)(d - boost::gregorian::date(1970, 1, 1)).days() * 86400 + hours * 3600 + minutes * 60 + seconds;
+  return true;
+}
+
+/* ETag - file version && normalized query, Last-Modified - file modification time as IMF-fixdate */
+void Connection::SetValidators() {
+  version.clear(); etag.clear(); last_modified.clear(); // expired status replaced by GETFILESTATUS result
+  if (!file_status)
+    return;
+  char buf[0x40];
+  version.assign(buf, StringFormat(buf, "@%llx-%llx",
+    (unsigned long long)file_status.modification_time, (unsigned long long)file_status.length));
+  std::string const normalized = RenderKey(std::string(), query);
+  etag.assign(buf, StringFormat(buf, "\"%llx-%llx-%08x\"",
+    (unsigned long long)file_status.modification_time, (unsigned long long)file_status.length, Fnv1a(normalized)));
+
+  boost::posix_time::ptime const t = boost::posix_time::from_time_t((time_t)(file_status.modification_time / 1000));
+  boost::gregorian::date const d = t.date();
+  boost::posix_time::time_duration const tod = t.time_of_day();
+  last_modified.assign(buf, StringFormat(buf, "%s, %02u %s %04u %02u:%02u:%02u GMT",
+    week_days[d.day_of_week().as_number()], (unsigned int)d.day(), months[d.month() - 1], (unsigned int)d.year(),
+    (unsigned int)tod.hours(), (unsigned int)tod.minutes(), (unsigned int)tod.seconds()));
+}
+
+/* If-None-Match takes precedence, If-Modified-Since - not modified after that date, modification time in seconds */
+bool Connection::NotModified() {
+  if (etag.empty())
+    return false;
+  StringPiece v;
+  if (request_parser.GetHeader(StringPieceFromLiteral("If-None-Match"), &v)) {
+    for (StringSplitIterator it(v, ','), tail; it != tail; ++it) {
+      StringPiece tag = *it;
+      while (!tag.empty() && ' ' == tag[0])
+        tag.remove_prefix(1);
+      while (!tag.empty() && ' ' == tag[tag.size() - 1])
+        tag.remove_suffix(1);
+      if (tag.starts_with(StringPieceFromLiteral("W/")))
+        tag.remove_prefix(2); // weak comparison
+      if (tag == StringPieceFromLiteral("*") || tag == StringPiece(etag))
+        return true;
+    }
+    return false;
+  }
+  cpcl::int64 since;
+  if (request_parser.GetHeader(StringPieceFromLiteral("If-Modified-Since"), &v) && ParseHttpDate(v, &since))
+    return file_status.modification_time / 1000 <= since;
+  return false;
+}
+
+/* Range applies if If-Range absent or names current ETag or Last-Modified, otherwise file changed and whole body sent */
+bool Connection::RangeApplies() {
+  StringPiece v;
+  if (!request_parser.GetHeader(StringPieceFromLiteral("If-Range"), &v))
+    return true;
+  return !etag.empty() && (v == StringPiece(etag) || v == StringPiece(last_modified));
+}
+
+/* one GETFILESTATUS per path at a time, other connections wait for its json */
+void Connection::StatFile() {
+  if (!context->stats->Join(webhdfs_path, boost::bind(&Connection::PostStatFlight, shared_from_this(), requests_count, _1, _2))) {
+    if (revalidating) {
+      revalidating = false; // refreshed by other connection, next request needn't wait
+      FinishResponse();
+    }
+    return; // wait for handle_stat_flight
+  }
+  stat_leader = true;
+  stat_request = true;
+  status_body = boost::make_shared<DynamicMemoryStream>();
+  parser.content = status_body;
+  Connect();
+}
+
+/*
+ * response written from expired file_status: GETFILESTATUS before next request,
+ * so client doesn't wait for it, only request pipelined on the same connection does
+ */
+void Connection::RevalidateStatus() {
+  status_stale = false;
+  revalidating = true;
+  StatFile();
+}
+
+/* value of integer field "name" of flat json object, no nesting or escapes expected */
+static bool JsonInteger(std::string const &json, char const *name, cpcl::int64 *v) {
+  std::string const key = std::string("\"") + name + "\"";
+  size_t i = json.find(key);
+  if (std::string::npos == i)
+    return false;
+  i += key.size();
+  while (i < json.size() && (' ' == json[i] || ':' == json[i]))
+    ++i;
+  size_t const head = i;
+  cpcl::int64 r(0);
+  for (; i < json.size() && json[i] >= '0' && json[i] <= '9'; ++i)
+    r = r * 10 + (json[i] - '0');
+  if (head == i)
+    return false;
+  *v = r;
+  return true;
+}
+
+void Connection::handle_read_status(boost::system::error_code const &ec, size_t bytes_transferred) {
+  if (responding && !revalidating)
+    return; // answered 504, webhdfs_socket closed
+  if ((!!ec || !bytes_transferred) && RetryRequest())
+    return;
+  webhdfs_received += bytes_transferred;
+  bool invalid_response(!!ec && boost::asio::error::eof != ec);
+  if (!invalid_response && bytes_transferred > 0)
+    invalid_response = !parser.Parse(reinterpret_cast<char const*>(buffer.data()), bytes_transferred);
+  if (!invalid_response && !parser.message_complete) {
+    if (!ec) {
+      webhdfs_socket->async_read_some(boost::asio::buffer(buffer),
+        strand.wrap(boost::bind(&Connection::handle_read_status, shared_from_this(),
+        boost::asio::placeholders::error,
+        boost::asio::placeholders::bytes_transferred)));
+      return;
+    }
+    invalid_response = true; // eof
+  }
+
+  ReleaseSocket();
+  if (invalid_response) {
+    Trace(CPCL_TRACE_LEVEL_WARNING,
+      "Connection(%08X)::handle_read_status(): GETFILESTATUS \"%s\" fails: %s",
+      (int)this, webhdfs_path.c_str(), ec.message().c_str());
+    HandleStatus(502);
+  } else
+    HandleStatus(parser.status_code);
+}
+
+/* leader result: cached and shared with waiting connections */
+void Connection::HandleStatus(int code) {
+  stat_request = false;
+  parser.content.reset();
+  SharedBuffer json;
+  if (200 == code)
+    json = status_body->Freeze();
+  status_body.reset();
+
+  ApplyStatus(code, json);
+  if (200 == code && !!file_status)
+    context->statuses->Put(webhdfs_path, file_status);
+  else if (404 == code)
+    context->statuses->Erase(webhdfs_path);
+  CompleteStat(code, json);
+  if (revalidating) {
+    revalidating = false;
+    FinishResponse();
+  } else if (404 == code)
+    SendResponse(404);
+  else
+    LookupRender();
+}
+
+/* missing file answered 404 right away, any other failure only loses validators, expired ones too */
+void Connection::ApplyStatus(int code, SharedBuffer const &json_buffer) {
+  status_stale = false;
+  file_status = FileStatus();
+  if (200 == code) {
+    std::string json(json_buffer.Size(), '\0');
+    if (!json.empty())
+      json.resize(json_buffer.Read(0, &json[0], json.size()));
+    FileStatus v;
+    if (JsonInteger(json, "length", &v.length) && JsonInteger(json, "modificationTime", &v.modification_time))
+      file_status = v;
+  }
+}
+
+void Connection::PostStatFlight(unsigned int request, int code, SharedBuffer const &v) {
+  strand.post(boost::bind(&Connection::handle_stat_flight, shared_from_this(), request, code, v));
+}
+
+void Connection::handle_stat_flight(unsigned int request, int code, SharedBuffer v) {
+  if (request != requests_count || responding)
+    return; // answered 504, or joined only to revalidate
+  ApplyStatus(code, v);
+  if (404 == code)
+    SendResponse(404);
+  else
+    LookupRender();
+}
+
+void Connection::CompleteStat(int code, SharedBuffer const &json) {
+  if (stat_leader) {
+    stat_leader = false;
+    context->stats->Complete(webhdfs_path, code, json);
+  }
+}
+
+/* webhdfs host unreachable: status lookup goes on without validators, download tries namenode or fails with 502 */
+void Connection::UpstreamFailed() {
+  if (stat_request) {
+    if (webhdfs_socket) {
+      CloseSocket(*webhdfs_socket);
+      webhdfs_socket.reset();
+    }
+    HandleStatus(502);
+  } else if (!FallbackToNamenode()) {
+    CompleteFetch(502);
+    SendResponse(502);
+  }
+}
+
+/* response sent, either close connection or continue with next request */
+void Connection::FinishResponse() {
+  processing = false;
+  ++requests_count;
+  ResetRequest();
+  if (!keep_alive || (client_eof && request_head == request_tail)) {
+    CloseClient();
+    return;
+  }
+  if (request_head < request_tail)
+    ParseRequest(client_eof); // pipelined request, client may have sent it right before half-close
+  else
+    ReadRequest();
+}
+
+/*
+ * lingering close: response may be still in flight, so only send side shut down,
+ * client data read and discarded until client closes or idle timer expires
+ */
+void Connection::CloseClient() {
+  closing = true;
+  boost::system::error_code ignored_ec;
+  if (client_eof) {
+    client_socket.close(ignored_ec);
+    return;
+  }
+  client_socket.shutdown(ip::tcp::socket::shutdown_send, ignored_ec);
+  if (!reading)
+    request_head = request_tail = 0;
+  ReadRequest(); // watch read already pending, arms idle timer
+}
+
+void Connection::ResetRequest() {
+  CompleteFetch(502);
+  CompleteRender(502);
+  CompleteStat(502, SharedBuffer());
+  if (webhdfs_socket) {
+    CloseSocket(*webhdfs_socket);
+    webhdfs_socket.reset();
+  }
+  host = namenode_host;
+  port = namenode_port;
+  location_cached = false;
+  probe_length = 0;
+  probed = false;
+  stat_request = false;
+  status_stale = revalidating = false;
+  status_body.reset();
+  file_status = FileStatus();
+  version.clear(); etag.clear(); last_modified.clear();
+
+  request_parser.Reset(true);
+  request_body->Clear();
+  request_received = 0;
+  query = Query();
+  cancel_token = CancelToken();
+  responding = false;
+
+  download.reset();
+  original = SharedBuffer();
+  original_hit = false;
+  image.reset();
+  stream.reset();
+  stream_writing = stream_eof = false;
+  stream_code = -1;
+  webhdfs_path.clear(); image_path.clear(); image_key.clear(); render_key.clear();
+  body = SharedBuffer();
+  body_hit = false;
+  status_code = -1;
 }
 
 Connection::Query Connection::GetQuery(std::string const &uri) {
@@ -93,6 +695,7 @@ Connection::Query Connection::GetQuery(std::string const &uri) {
     StringPiece width_key = StringPieceFromLiteral("w");
     StringPiece height_key = StringPieceFromLiteral("h");
     StringPiece json_key = StringPieceFromLiteral("info");
+    StringPiece timeout_key = StringPieceFromLiteral("timeout");
     for (StringSplitIterator it(query, '&'), tail; it != tail; ++it) {
       if (StringEqualsIgnoreCaseASCII(json_key, *it)) {
         r.json = true;
@@ -100,8 +703,8 @@ Connection::Query Connection::GetQuery(std::string const &uri) {
       } else {
         std::pair<StringPiece, StringPiece> key_value = SplitPair(*it, '=');
         if (!key_value.second.empty()) {
-          StringPiece keys[] = { width_key, height_key };
-          unsigned int Query::*values[] = { &Query::width, &Query::height };
+          StringPiece keys[] = { width_key, height_key, timeout_key };
+          unsigned int Query::*values[] = { &Query::width, &Query::height, &Query::timeout };
           for (size_t i = 0; i < arraysize(keys); ++i) {
             if (StringEqualsIgnoreCaseASCII(key_value.first, keys[i])) {
               unsigned int value;
@@ -117,34 +720,41 @@ Connection::Query Connection::GetQuery(std::string const &uri) {
   return r;
 }
 
-void Connection::handle_read_request(boost::system::error_code const &ec, size_t bytes_transferred) {
-  if (!ec || boost::asio::error::eof == ec) {
-    bool invalid_request(false);
-    if (bytes_transferred > 0)
-      invalid_request = !parser.Parse(reinterpret_cast<char const*>(buffer.data()), bytes_transferred);
-    if (!invalid_request && boost::asio::error::eof == ec)
-      invalid_request = !parser.headers_complete;
+/* normalized query: w && h not used for json, zero means "not specified", timeout doesn't change result */
+std::string Connection::RenderKey(std::string const &path, Query const &query) {
+  if (query.json)
+    return path + "?info";
+  char buf[0x30];
+  return path + std::string(buf, StringFormat(buf, "?w=%u&h=%u", query.width, query.height));
+}
 
-    if (invalid_request) {
-      SendResponse(400);
-    } else {
-      if (parser.headers_complete) {
-        query = GetQuery(parser.url);
-        if (parser.HttpMethod() != HTTP_GET || query.request_path.size() < 2) {
-          SendResponse(400);
-        } else {
-          webhdfs_path.assign(query.request_path.data(), query.request_path.size());
-          SendRequest(webhdfs_path);
-        }
-      } else {
-        client_socket.async_read_some(boost::asio::buffer(buffer),
-          boost::bind(&Connection::handle_read_request, shared_from_this(),
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
-      }
+void Connection::handle_read_request(boost::system::error_code const &ec, size_t bytes_transferred) {
+  reading = false;
+  if (closing) {
+    if (!ec) {
+      request_head = request_tail = 0; // discarded, connection is closing
+      ReadClient();
+    } else
+      StopWaiting(); // no more operations, connection destroyed
+  } else if (processing) {
+    request_tail += bytes_transferred;
+    if (!ec && bytes_transferred > 0) {
+      ReadClient();
+    } else if (!ec || boost::asio::error::eof == ec) {
+      client_eof = true; // half-close: client still reads response, connection closed after it
+    } else if (boost::asio::error::operation_aborted != ec) {
+      Trace(CPCL_TRACE_LEVEL_DEBUG,
+        "Connection(%08X)::handle_read_request(): client gone while request processed: %s",
+        (int)this, ec.message().c_str());
+      keep_alive = false;
+      CancelRender();
     }
+  } else if (!ec || boost::asio::error::eof == ec) {
+    request_tail += bytes_transferred;
+    ParseRequest(boost::asio::error::eof == ec);
   } else {
-    Trace(CPCL_TRACE_LEVEL_ERROR,
+    StopWaiting();
+    Trace((boost::asio::error::operation_aborted == ec) ? CPCL_TRACE_LEVEL_DEBUG : CPCL_TRACE_LEVEL_ERROR,
       "Connection(%08X)::handle_read_request() fails: %s",
       (int)this, ec.message().c_str());
 
@@ -160,11 +770,16 @@ size_t Connection::BuildRequest(std::string const &request_path) {
   char *buf = reinterpret_cast<char*>(buffer.data());
   size_t buf_len(buffer.size());
   
-  buf_len -= StringFormat(buf, buf_len, "GET /webhdfs/v1%s?op=OPEN HTTP/1.1\r\n", request_path.c_str());
+  if (stat_request)
+    buf_len -= StringFormat(buf, buf_len, "GET /webhdfs/v1%s?op=GETFILESTATUS HTTP/1.1\r\n", request_path.c_str());
+  else if (probe_length > 0)
+    buf_len -= StringFormat(buf, buf_len, "GET /webhdfs/v1%s?op=OPEN&offset=0&length=%lu HTTP/1.1\r\n", request_path.c_str(), (unsigned long)probe_length);
+  else
+    buf_len -= StringFormat(buf, buf_len, "GET /webhdfs/v1%s?op=OPEN HTTP/1.1\r\n", request_path.c_str());
   buf += buffer.size() - buf_len;
   
   WriteHeader(buf, buf_len, StringPieceFromLiteral("Host"), host);
-  WriteHeader(buf, buf_len, StringPieceFromLiteral("Connection"), StringPieceFromLiteral("close"));
+  WriteHeader(buf, buf_len, StringPieceFromLiteral("Connection"), StringPieceFromLiteral("keep-alive"));
   StringAdvance(buf, buf_len, StringPieceFromLiteral("\r\n"));
   
   if (TRACE_LEVEL & CPCL_TRACE_LEVEL_DEBUG) {
@@ -182,78 +797,173 @@ void Connection::SendRequest(std::string const &request_path) {
   }
 
   webhdfs_path = request_path;
-  if (!image) {
+  if (!download) {
     image_path = webhdfs_path;
-    ImageCache::ItemHit r = image_cache->Get(image_path);
-    image = r.first;
+    image_key = image_path + version;
+    ImageCache::ItemHit r = context->image_cache->Get(image_key);
     if (r.second) {
+      original = r.first;
+      original_hit = true;
       SendPage();
       return;
     }
-  } else
-    image->Seek(0, SEEK_SET, NULL);
-  parser.content = image;
-  
-  ip::tcp::resolver::query query(host, port, ip::resolver_query_base::v4_mapped |
-    /*ip::resolver_query_base::numeric_host |*/ ip::resolver_query_base::numeric_service);
-  resolver.async_resolve(query,
-    boost::bind(&Connection::handle_resolve, shared_from_this(),
+    if (!context->disk_cache->AsyncGet("original:" + image_key,
+      boost::bind(&Connection::PostDiskOriginal, shared_from_this(), requests_count, _1)))
+      FetchOriginal();
+    // else wait for handle_disk_original
+  } else {
+    download->Clear(); // drop body of redirect response
+    parser.content = download;
+    Connect();
+  }
+}
+
+/* original not cached: ranged probe for ?info, otherwise lead or join fetch flight */
+void Connection::FetchOriginal() {
+  if (query.json && !probed && context->options.info_probe_bytes > 0) {
+    probe_length = context->options.info_probe_bytes; // header is enough, no fetch flight
+  } else {
+    if (!context->fetches->Join(image_key, boost::bind(&Connection::PostFetchFlight, shared_from_this(), requests_count, _1, _2)))
+      return; // wait for handle_fetch_flight
+    fetch_leader = true;
+  }
+  download = boost::make_shared<DynamicMemoryStream>();
+
+  std::string location;
+  if (context->locations->Get(image_path, &location) && SetLocation(location))
+    location_cached = true; // go straight to datanode
+  parser.content = download;
+  Connect();
+}
+
+void Connection::Connect() {
+  webhdfs_received = 0;
+  webhdfs_socket = context->upstream_pool->Acquire(host, port);
+  webhdfs_reused = !!webhdfs_socket;
+  if (webhdfs_reused)
+    WriteRequest();
+  else
+    Resolve();
+}
+
+void Connection::Resolve() {
+  webhdfs_socket.reset(new ip::tcp::socket(io_service));
+  webhdfs_reused = false;
+
+  context->dns_cache->Resolve(host, port,
+    strand.wrap(boost::bind(&Connection::handle_resolve, shared_from_this(), _1, _2)));
+}
+
+/*
+ * webhdfs may close idle keep-alive socket at any moment, so write to reused socket can fail
+ * or read returns eof before response; GET is idempotent, so send it once again on fresh socket
+ */
+bool Connection::RetryRequest() {
+  if (!webhdfs_reused || webhdfs_received > 0)
+    return false;
+  Trace(CPCL_TRACE_LEVEL_DEBUG,
+    "Connection(%08X)::RetryRequest(): stale keep-alive socket to %s:%s",
+    (int)this, host.c_str(), port.c_str());
+  CloseSocket(*webhdfs_socket);
+  Resolve();
+  return true;
+}
+
+/*
+ * cached datanode Location failed(datanode down, block moved, file replaced),
+ * forget it and start over from namenode
+ */
+bool Connection::FallbackToNamenode() {
+  if (!location_cached)
+    return false;
+  location_cached = false;
+  Trace(CPCL_TRACE_LEVEL_WARNING,
+    "Connection(%08X)::FallbackToNamenode(): cached location %s:%s for \"%s\" failed",
+    (int)this, host.c_str(), port.c_str(), image_path.c_str());
+  context->locations->Erase(image_path);
+  ReleaseSocket();
+  host = namenode_host;
+  port = namenode_port;
+  SendRequest(image_path);
+  return true;
+}
+
+/* response read completely && webhdfs allows keep-alive - socket goes back to pool, otherwise closed */
+void Connection::ReleaseSocket() {
+  if (!webhdfs_socket)
+    return;
+  if (webhdfs_received > 0 && parser.message_complete && parser.ShouldKeepAlive())
+    context->upstream_pool->Release(host, port, webhdfs_socket);
+  else
+    CloseSocket(*webhdfs_socket);
+  webhdfs_socket.reset();
+}
+
+void Connection::WriteRequest() {
+  size_t n(BuildRequest(webhdfs_path));
+
+  boost::asio::async_write(*webhdfs_socket, boost::asio::buffer(buffer, n),
+    strand.wrap(boost::bind(&Connection::handle_write_request, shared_from_this(),
     boost::asio::placeholders::error,
-    boost::asio::placeholders::iterator));
+    boost::asio::placeholders::bytes_transferred)));
 }
 
-void Connection::handle_resolve(boost::system::error_code const &ec, ip::tcp::resolver::iterator endpoint_iterator) {
+void Connection::handle_resolve(boost::system::error_code const &ec, DnsCache::Endpoints const &v) {
+  if (responding && !revalidating)
+    return; // answered 504, webhdfs_socket closed
   if (!ec) {
     // Attempt a connection to the first endpoint in the list.
     // Each endpoint will be tried until we successfully establish a connection.
-    ip::tcp::endpoint endpoint = *endpoint_iterator;
-    webhdfs_socket.async_connect(endpoint,
-      boost::bind(&Connection::handle_connect, shared_from_this(),
+    endpoints = v;
+    webhdfs_socket->async_connect(endpoints[0],
+      strand.wrap(boost::bind(&Connection::handle_connect, shared_from_this(),
       boost::asio::placeholders::error,
-      ++endpoint_iterator));
+      1)));
   } else {
     Trace(CPCL_TRACE_LEVEL_ERROR,
       "Connection(%08X)::handle_resolve() fails: %s",
       (int)this, ec.message().c_str());
+    UpstreamFailed();
   }
 }
 
-void Connection::handle_connect(boost::system::error_code const &ec, ip::tcp::resolver::iterator endpoint_iterator) {
+void Connection::handle_connect(boost::system::error_code const &ec, size_t endpoint_index) {
+  if (responding && !revalidating)
+    return; // answered 504, webhdfs_socket closed
   if (!ec) {
     // The connection was successful. Send request.
-    size_t n(BuildRequest(webhdfs_path));
-    
-    boost::asio::async_write(webhdfs_socket, boost::asio::buffer(buffer, n),
-      boost::bind(&Connection::handle_write_request, shared_from_this(),
-      boost::asio::placeholders::error,
-      boost::asio::placeholders::bytes_transferred));
-  } else if (endpoint_iterator != ip::tcp::resolver::iterator()) {
+    WriteRequest();
+  } else if (endpoint_index < endpoints.size()) {
     // The connection failed. Try the next endpoint in the list.
-    webhdfs_socket.close();
-    ip::tcp::endpoint endpoint = *endpoint_iterator;
-    webhdfs_socket.async_connect(endpoint,
-      boost::bind(&Connection::handle_connect, shared_from_this(),
+    webhdfs_socket->close();
+    webhdfs_socket->async_connect(endpoints[endpoint_index],
+      strand.wrap(boost::bind(&Connection::handle_connect, shared_from_this(),
       boost::asio::placeholders::error,
-      ++endpoint_iterator));
+      endpoint_index + 1)));
   } else {
     Trace(CPCL_TRACE_LEVEL_ERROR,
       "Connection(%08X)::handle_connect() fails: %s",
       (int)this, ec.message().c_str());
+    UpstreamFailed();
   }
 }
 
 void Connection::handle_write_request(boost::system::error_code const &ec, size_t bytes_transferred) {
+  if (responding && !revalidating)
+    return; // answered 504, webhdfs_socket closed
   if (!ec) {
     parser.Reset(false);
+    webhdfs_received = 0;
     
-    webhdfs_socket.async_read_some(boost::asio::buffer(buffer),
-      boost::bind(&Connection::handle_read_webhdfs_response, shared_from_this(),
+    webhdfs_socket->async_read_some(boost::asio::buffer(buffer),
+      strand.wrap(boost::bind(stat_request ? &Connection::handle_read_status : &Connection::handle_read_webhdfs_response, shared_from_this(),
       boost::asio::placeholders::error,
-      boost::asio::placeholders::bytes_transferred));
-  } else {
+      boost::asio::placeholders::bytes_transferred)));
+  } else if (!RetryRequest()) {
     Trace(CPCL_TRACE_LEVEL_ERROR,
       "Connection(%08X)::handle_write_request() fails: %s",
       (int)this, ec.message().c_str());
+    UpstreamFailed();
   }
 }
 
@@ -289,14 +999,12 @@ bool Connection::SetLocation(cpcl::StringPiece const &uri) {
   return true;
 }
 
-static inline void CloseSocket(ip::tcp::socket &socket) {
-  boost::system::error_code ignored_ec;
-  socket.shutdown(ip::tcp::socket::shutdown_both, ignored_ec);
-  ignored_ec = boost::system::error_code();
-  socket.close(ignored_ec);
-}
-
 void Connection::handle_read_webhdfs_response(boost::system::error_code const &ec, size_t bytes_transferred) {
+  if (responding)
+    return; // answered 504, webhdfs_socket closed
+  if ((!!ec || !bytes_transferred) && RetryRequest())
+    return;
+  webhdfs_received += bytes_transferred;
   if (!ec || boost::asio::error::eof == ec) {
     bool invalid_response(false);
     if (bytes_transferred > 0)
@@ -310,7 +1018,10 @@ void Connection::handle_read_webhdfs_response(boost::system::error_code const &e
     }
     
     if (invalid_response) {
-      SendResponse(500);
+      if (!FallbackToNamenode()) {
+        CompleteFetch(500); // waiters answered now, not after response written
+        SendResponse(500);
+      }
     } else {
       bool redirect(false);
       if (parser.headers_complete) {
@@ -323,12 +1034,15 @@ void Connection::handle_read_webhdfs_response(boost::system::error_code const &e
           cpcl::Trace(CPCL_TRACE_LEVEL_ERROR,
             "Connection(%08X)::handle_read_webhdfs_response(): redirect response from webhdfs doesn't contain location field",
             (int)this);
+          CompleteFetch(500);
           SendResponse(500);
         } else {
+          ReleaseSocket(); // before SetLocation changes host:port
           if (!SetLocation(uri)) {
+            CompleteFetch(500);
             SendResponse(500);
           } else {
-            CloseSocket(webhdfs_socket);
+            context->locations->Put(image_path, uri.as_string());
             SendRequest(webhdfs_path);
           }
         }
@@ -337,28 +1051,41 @@ void Connection::handle_read_webhdfs_response(boost::system::error_code const &e
         if (parser.headers_complete) {
           if (parser.status_code != 200) {
             read_more = false;
-            SendResponse(parser.status_code);
+            ReleaseSocket();
+            if (!FallbackToNamenode()) {
+              CompleteFetch(parser.status_code);
+              SendResponse(parser.status_code);
+            }
           } else {
             if (parser.message_complete) {
               read_more = false;
-              SendPage();
+              ReleaseSocket();
+              if (probe_length > 0) {
+                HandleProbe();
+              } else {
+                original = download->Freeze();
+                download.reset();
+                parser.content.reset();
+                CompleteFetch(200);
+                SendPage();
+              }
             } else if (boost::asio::error::eof == ec) {
               read_more = false;
+              ReleaseSocket();
               cpcl::Trace(CPCL_TRACE_LEVEL_ERROR,
                 "Connection(%08X)::handle_read_webhdfs_response(): eof, !parser.message_complete",
                 (int)this);
+              CompleteFetch(500);
               SendResponse(500);
             }
           }
         }
 
         if (read_more) {
-          webhdfs_socket.async_read_some(boost::asio::buffer(buffer),
-            boost::bind(&Connection::handle_read_webhdfs_response, shared_from_this(),
+          webhdfs_socket->async_read_some(boost::asio::buffer(buffer),
+            strand.wrap(boost::bind(&Connection::handle_read_webhdfs_response, shared_from_this(),
             boost::asio::placeholders::error,
-            boost::asio::placeholders::bytes_transferred));
-        } else {
-          CloseSocket(webhdfs_socket);
+            boost::asio::placeholders::bytes_transferred)));
         }
       }
     }
@@ -366,51 +1093,280 @@ void Connection::handle_read_webhdfs_response(boost::system::error_code const &e
     cpcl::Trace(CPCL_TRACE_LEVEL_ERROR,
       "Connection(%08X)::handle_read_webhdfs_response() fails: %s",
       (int)this, ec.message().c_str());
+    ReleaseSocket();
+    UpstreamFailed(); // client watch read keeps connection alive, so waiters and client must be answered
+  }
+}
+
+/*
+ * leading bytes of original downloaded: answer ?info from image header,
+ * read longer prefix if header needs it, otherwise decode whole file:
+ * probe shorter than asked is the whole file already, else it downloaded once again
+ */
+void Connection::HandleProbe() {
+  SharedBuffer const head = download->Freeze();
+  std::vector<unsigned char> data(head.Size());
+  if (!data.empty())
+    data.resize(head.Read(0, &data[0], data.size()));
+
+  ImageHeader header;
+  size_t need(0);
+  if (!data.empty() && ParseImageHeader(&data[0], data.size(), &header, &need)) {
+    download.reset();
+    parser.content.reset();
+    context->metadata->Put(MetadataCache::KeyOf(image_path, version), header);
+    DynamicMemoryStream info;
+    WriteImageInfo(header, &info);
+    body = info.Freeze();
+    SendResponse(200);
+  } else if (need > data.size() && data.size() == probe_length && need <= context->options.info_probe_limit) {
+    probe_length = (std::min)((std::max)(need, probe_length * 2), (size_t)context->options.info_probe_limit);
+    Connect(); // same host, download already cleared by Freeze
+  } else if (data.size() < probe_length && !data.empty()) {
+    probe_length = 0;
+    probed = true;
+    download.reset();
+    parser.content.reset();
+    original = head; // put to image_cache if decoded
+    SendPage();
+  } else {
+    Trace(CPCL_TRACE_LEVEL_DEBUG,
+      "Connection(%08X)::HandleProbe(): header of \"%s\" not parsed in %u bytes, download whole file",
+      (int)this, image_path.c_str(), (unsigned int)data.size());
+    probe_length = 0;
+    probed = true;
+    download.reset();
+    parser.content.reset();
+    host = namenode_host;
+    port = namenode_port;
+    location_cached = false;
+    SendRequest(image_path);
+  }
+}
+
+/* memory tier right away, disk tier written in background */
+void Connection::PutOriginal() {
+  context->image_cache->Put(image_key, original);
+  context->disk_cache->Put("original:" + image_key, original);
+}
+void Connection::PutRender() {
+  context->render_cache->Put(render_key, body);
+  context->disk_cache->Put("render:" + render_key, body);
+}
+
+/* disk tier read and faulted in by disk_cache reader thread */
+void Connection::PostDiskOriginal(unsigned int request, SharedBuffer const &v) {
+  strand.post(boost::bind(&Connection::handle_disk_original, shared_from_this(), request, v));
+}
+void Connection::PostDiskRender(unsigned int request, SharedBuffer const &v) {
+  strand.post(boost::bind(&Connection::handle_disk_render, shared_from_this(), request, v));
+}
+
+void Connection::handle_disk_original(unsigned int request, SharedBuffer v) {
+  if (request != requests_count || responding)
+    return; // answered 504
+  if (!!v) {
+    original = v;
+    context->image_cache->Put(image_key, original);
+    original_hit = true;
+    SendPage();
+  } else
+    FetchOriginal();
+}
+
+void Connection::handle_disk_render(unsigned int request, SharedBuffer v) {
+  if (request != requests_count || responding)
+    return; // answered 504
+  if (!!v) {
+    body = v;
+    context->render_cache->Put(render_key, body);
+    body_hit = true;
+    SendResponse(200);
+  } else
+    JoinRender();
+}
+
+void Connection::PostFetchFlight(unsigned int request, int code, SharedBuffer const &v) {
+  strand.post(boost::bind(&Connection::handle_fetch_flight, shared_from_this(), request, code, v));
+}
+void Connection::PostRenderFlight(unsigned int request, int code, SharedBuffer const &v) {
+  strand.post(boost::bind(&Connection::handle_render_flight, shared_from_this(), request, code, v));
+}
+
+void Connection::CompleteFetch(int code) {
+  if (fetch_leader) {
+    fetch_leader = false;
+    context->fetches->Complete(image_key, code, (200 == code) ? original : SharedBuffer());
+  }
+}
+void Connection::CompleteRender(int code) {
+  if (render_leader) {
+    render_leader = false;
+    context->renders->Complete(render_key, code, (200 == code) ? body : SharedBuffer());
   }
 }
 
-static inline void FitPage(boost::shared_ptr<plcl::Page> page, unsigned int sw, unsigned int sh) {
-  page->Width(sw);
-  if (page->Height() > sh)
-    page->Height(sh);
+void Connection::handle_fetch_flight(unsigned int request, int code, SharedBuffer v) {
+  if (request != requests_count || responding)
+    return; // answered 504
+  if (200 == code && !!v) {
+    original = v;
+    original_hit = true; // leader puts it to image_cache
+    SendPage();
+  } else
+    SendResponse((200 == code) ? 500 : code);
+}
+
+void Connection::handle_render_flight(unsigned int request, int code, SharedBuffer v) {
+  if (request != requests_count || responding)
+    return; // answered 504
+  if (200 == code && !!v) {
+    body = v;
+    body_hit = true;
+    SendResponse(200);
+  } else
+    SendResponse((200 == code) ? 500 : code);
 }
+
+/* decode && render on TaskPool, worker calls RenderComplete */
 void Connection::SendPage() {
-  image->Seek(0, SEEK_SET, NULL);
-
-  boost::shared_ptr<plcl::Doc> doc = plugin_list->LoadDoc(image.get());
-  if (doc) {
-    boost::shared_ptr<plcl::Page> page = doc->GetPage(0);
-    if (page) {
-      image_cache->Put(image_path, image);
-      if (query.json) {
-        page_width = page->Width(); page_height = page->Height(); page_pixfmt = page->GuessPixfmt();
-
-        image.reset();
-        SendResponse(200);
-      } else {
-        if (query.width > 0 && query.height > 0)
-          FitPage(page, query.width, query.height);
-        else if (!query.width && query.height > 0)
-          page->Height(query.height);
-        else if (query.width > 0 && !query.height)
-          page->Width(query.width);
-
-        image.reset(new DynamicMemoryStream());
-        if (!task_pool->AddTask(shared_from_this(), page, image))
-          SendResponse(500);
-      }
-    } else {
-      cpcl::Trace(CPCL_TRACE_LEVEL_ERROR,
-        "Connection(%08X)::SendPage(): unable to get page 0 from document \"%s\"",
-        (int)this, image_path.c_str());
-    }
+  TaskPool::Task task;
+  task.connection = shared_from_this();
+  task.plugin_list = plugin_list;
+  task.original = original;
+  task.width = query.width;
+  task.height = query.height;
+  task.json = query.json;
+  task.metadata = context->metadata;
+  task.docs = context->docs;
+  task.doc_key = image_key;
+  task.metadata_key = MetadataCache::KeyOf(image_path, version);
+  ImageHeader header;
+  if (!query.json && context->metadata->Get(task.metadata_key, &header)) {
+    task.page_width = header.width;
+    task.page_height = header.height;
+  }
+  // ranged request needs whole body before response starts
+  if (!query.json && context->options.render_stream_buffer > 0 && !request_parser.GetHeader(StringPieceFromLiteral("Range"), 0)) {
+    stream = boost::make_shared<StreamPipe>(context->options.render_stream_buffer, context->options.render_stream_cache_limit, cancel_token.Deadline(),
+      boost::bind(&Connection::NotifyStream, boost::weak_ptr<Connection>(shared_from_this())));
+    task.out = stream;
+    task.stream = stream;
   } else {
-    cpcl::Trace(CPCL_TRACE_LEVEL_ERROR,
-      "Connection(%08X)::SendPage(): unable to load document \"%s\"",
-      (int)this, image_path.c_str());
+    image.reset(new DynamicMemoryStream());
+    task.out = image;
+  }
+  task.cancel_token = cancel_token;
+  int const code = context->task_pool->AddTask(task);
+  if (code != 202) {
+    stream.reset();
+    SendResponse(code); // 503 - render pool saturated, shed load
+  }
+}
+
+void Connection::RenderComplete(CancelToken const &token, int code) {
+  strand.dispatch(boost::bind(&Connection::handle_render_complete, shared_from_this(), token, code));
+}
+
+void Connection::handle_render_complete(CancelToken const &token, int code) {
+  if (token != cancel_token)
+    return; // answered 504, connection may already serve next request
+  if (stream)
+    CompleteStream(code);
+  else if (!responding)
+    SendResponse(code);
+}
+
+/* pipe keeps only weak reference, render task holds connection while worker writes */
+void Connection::NotifyStream(boost::weak_ptr<Connection> const &connection) {
+  boost::shared_ptr<Connection> p = connection.lock();
+  if (!!p)
+    p->strand.post(boost::bind(&Connection::WriteStream, p));
+}
+
+/* send what worker encoded so far, one write at a time: headers, then chunks, then last chunk once render complete */
+void Connection::WriteStream() {
+  if (stream_writing || !stream || stream->Closed())
+    return;
+  if (!responding) {
+    responding = true;
+    status_code = 200;
+    stream_writing = true;
+    size_t n(BuildResponse(200, 0, 0, 0));
+    boost::asio::async_write(client_socket, boost::asio::buffer(buffer, n),
+      strand.wrap(boost::bind(&Connection::handle_write_stream, shared_from_this(),
+      boost::asio::placeholders::error,
+      boost::asio::placeholders::bytes_transferred)));
+    return;
+  }
+
+  size_t n = stream->Read(buffer.data() + CHUNK_OFFSET, MAX_CHUNK_SIZE);
+  if (!n) {
+    if (stream_code < 0)
+      return; // worker still encodes, next Write notifies
+    if (stream_code != 200) {
+      AbortStream(); // headers already sent, client sees truncated chunked body
+      return;
+    }
+    stream_eof = true;
+  }
+  stream_writing = true;
+  boost::asio::async_write(client_socket, BuildChunk(n),
+    strand.wrap(boost::bind(&Connection::handle_write_stream, shared_from_this(),
+    boost::asio::placeholders::error,
+    boost::asio::placeholders::bytes_transferred)));
+}
 
-    SendResponse(500);
+/* worker finished: share tee with waiting connections, then drain the pipe */
+void Connection::CompleteStream(int code) {
+  stream_code = code;
+  boost::system::error_code ignored_ec;
+  request_timer.cancel(ignored_ec);
+
+  if (200 == code) {
+    body = stream->Tee();
+    if (!!body) {
+      if (!!original && !original_hit)
+        PutOriginal();
+      PutRender();
+      body_hit = true;
+    } else
+      code = 503; // too large to keep, waiters render it themselves after Retry-After
   }
+  CompleteRender(code);
+
+  if (stream->Closed()) {
+    stream.reset(); // client gone, render kept for waiters only
+  } else if (!responding && code == stream_code) {
+    // nothing written, answer as buffered render
+    stream.reset();
+    SendResponse(stream_code);
+  } else
+    WriteStream(); // tee overflow: not cached, still streamed to client, headers first if not sent
+}
+
+/* client can't get complete stream: worker stops waiting for it, connection closed */
+void Connection::AbortStream() {
+  keep_alive = false;
+  CancelRender();
+  CloseSocket(client_socket);
+  if (stream_code >= 0)
+    stream.reset();
+}
+
+void Connection::handle_write_stream(boost::system::error_code const &ec, size_t bytes_transferred) {
+  stream_writing = false;
+  if (!!ec) {
+    cpcl::Trace(CPCL_TRACE_LEVEL_ERROR,
+      "Connection(%08X)::handle_write_stream() fails: %s",
+      (int)this, ec.message().c_str());
+    AbortStream();
+  } else if (stream_eof) {
+    stream.reset();
+    body = SharedBuffer();
+    FinishResponse();
+  } else
+    WriteStream();
 }
 
 struct Response {
@@ -418,17 +1374,23 @@ struct Response {
   char const *message;
 } static responses[] = {
   { 200, "OK" },
+  { 206, "Partial Content" },
   { 302, "Found" },
+  { 304, "Not Modified" },
   { 400, "Invalid request" },
   { 404, "Not Found" },
-  { 500, "Server error" }
+  { 416, "Range Not Satisfiable" },
+  { 500, "Server error" },
+  { 502, "Bad Gateway" },
+  { 503, "Service Unavailable" },
+  { 504, "Gateway Timeout" }
 };
 struct CompareResponse {
   bool operator()(Response const &a, Response const &b) const {
     return a.code < b.code;
   }
 };
-size_t Connection::BuildResponse(int code, size_t response_len) {
+size_t Connection::BuildResponse(int code, size_t offset, size_t response_len, size_t total) {
   Response v; v.code = code;
   Response *it = std::lower_bound(responses, responses + arraysize(responses), v, CompareResponse());
   char const *message = "Not Implemented";
@@ -441,63 +1403,113 @@ size_t Connection::BuildResponse(int code, size_t response_len) {
   buf_len -= StringFormat(buf, buf_len, "HTTP/1.1 %d %s\r\n", code, message);
   buf += buffer.size() - buf_len;
   
-  char json_response[0x100];
-  if (200 == code) {
-    // webhdfs
-    WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Connection"), cpcl::StringPieceFromLiteral("close"));
-    if (!query.json) {
+  WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Connection"),
+    keep_alive ? cpcl::StringPieceFromLiteral("keep-alive") : cpcl::StringPieceFromLiteral("close"));
+  if (200 == code || 206 == code || 304 == code) {
+    if (!etag.empty()) {
+      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("ETag"), etag);
+      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Last-Modified"), last_modified);
+    }
+    std::string const *cache_control = context->options.CacheControl(webhdfs_path);
+    if (!!cache_control)
+      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Cache-Control"), *cache_control);
+  }
+  if (304 == code) {
+    // no body and no Content-Length, validators only
+  } else if (200 == code || 206 == code) {
+    if (!query.json)
       WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Content-Type"), cpcl::StringPieceFromLiteral("image/jpeg"));
+    else
+      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Content-Type"), cpcl::StringPieceFromLiteral("application/json"));
+    if (!!stream) {
+      // size unknown until worker finishes
       WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Transfer-Encoding"), cpcl::StringPieceFromLiteral("chunked"));
     } else {
-      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Content-Type"), cpcl::StringPieceFromLiteral("application/json"));
-      
-      char const* pf_s[] = { "invalid", "gray8", "rgb24", "bgr24", "rgba32", "argb32", "abgr32", "bgra32" };
-      unsigned int pf[] = { PLCL_PIXEL_FORMAT_INVALID, PLCL_PIXEL_FORMAT_GRAY_8, PLCL_PIXEL_FORMAT_RGB_24, PLCL_PIXEL_FORMAT_BGR_24, PLCL_PIXEL_FORMAT_RGBA_32, PLCL_PIXEL_FORMAT_ARGB_32, PLCL_PIXEL_FORMAT_ABGR_32, PLCL_PIXEL_FORMAT_BGRA_32 };
-      unsigned int *it = std::lower_bound(pf, pf + arraysize(pf), page_pixfmt);
-      size_t i(0);
-      if (!(pf + arraysize(pf) == it || *it != page_pixfmt))
-        i = it - pf;
-      response_len = cpcl::StringFormat(json_response,
-        "{'width' : '%u', 'height' : '%u', 'pf' : '%s'}",
-        page_width, page_height, pf_s[i]);
-      
-      char json_response_len_buf[0x10];
-      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Content-Length"), StringPiece(json_response_len_buf, StringFormat(json_response_len_buf, "%u", response_len)));
+      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Accept-Ranges"), cpcl::StringPieceFromLiteral("bytes"));
+      if (206 == code) {
+        char content_range_buf[0x40];
+        WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Content-Range"), StringPiece(content_range_buf, StringFormat(content_range_buf, "bytes %lu-%lu/%lu",
+          (unsigned long)offset, (unsigned long)(offset + response_len - 1), (unsigned long)total)));
+      }
+      char response_len_buf[0x20];
+      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Content-Length"), StringPiece(response_len_buf, StringFormat(response_len_buf, "%lu", (unsigned long)response_len)));
     }
+  } else {
+    if (503 == code) {
+      char retry_after_buf[0x10];
+      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Retry-After"), StringPiece(retry_after_buf, StringFormat(retry_after_buf, "%u", context->options.retry_after)));
+    } else if (416 == code) {
+      char content_range_buf[0x20];
+      WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Content-Range"), StringPiece(content_range_buf, StringFormat(content_range_buf, "bytes */%lu", (unsigned long)total)));
+    }
+    // no body, but keep-alive client needs message length
+    WriteHeader(buf, buf_len, cpcl::StringPieceFromLiteral("Content-Length"), cpcl::StringPieceFromLiteral("0"));
   }
   StringAdvance(buf, buf_len, StringPieceFromLiteral("\r\n"));
-  
-  if (200 == code && query.json) {
-    response_len = (std::min)(response_len, buf_len);
-    memcpy(buf, json_response, response_len);
-    buf_len -= response_len;
-  }
   return buffer.size() - buf_len;
 }
 
+/* append memory blocks of v[offset, offset + size) to buffers, no copy */
+static void AppendBlocks(SharedBuffer const &v, size_t offset, size_t size, std::vector<boost::asio::const_buffer> *buffers) {
+  while (size > 0) {
+    std::pair<unsigned char const*, size_t> block = v.Block(offset);
+    if (!block.second)
+      break;
+    size_t const n = (std::min)(block.second, size);
+    buffers->push_back(boost::asio::const_buffer(block.first, n));
+    offset += n;
+    size -= n;
+  }
+}
+
 void Connection::SendResponse(int code) {
+  responding = true;
+  boost::system::error_code ignored_ec;
+  request_timer.cancel(ignored_ec);
+
   size_t response_len(0);
-  if (200 == code && !query.json) {
-    if (!image) {
-      Error(StringPieceFromLiteral("Connection::SendResponse(): no image for non-json query"));
+  if (200 == code) {
+    if (!body && !!image) {
+      // rendered image, freeze and put to render cache
+      body = image->Freeze();
+      image.reset();
+    }
+    if (!body || !body.Size()) {
+      Error(StringPieceFromLiteral("Connection::SendResponse(): empty response"));
       code = 500;
     } else {
-      image->Seek(0, SEEK_SET, NULL);
-      response_len = (size_t)image->Size();
-      if (!response_len) {
-        Error(StringPieceFromLiteral("Connection::SendResponse(): empty image response"));
-        code = 500;
-      }
+      if (!!original && !original_hit) // decoded successfully, worth caching
+        PutOriginal();
+      if (!body_hit)
+        PutRender();
+      response_len = body.Size();
     }
-  } else
+  }
+  if (code != 200) {
     image.reset();
+    body = SharedBuffer();
+  }
+  CompleteRender(code);
+
+  // whole body shared with waiters and cached, client may ask only part of it
+  size_t offset(0), total(response_len);
+  StringPiece range;
+  if (200 == code && request_parser.GetHeader(StringPieceFromLiteral("Range"), &range) && RangeApplies()) {
+    code = ByteRange(range, total, &offset, &response_len);
+    if (416 == code)
+      response_len = 0;
+  }
   status_code = code;
-  size_t n(BuildResponse(code, response_len));
+  size_t n(BuildResponse(code, offset, response_len, total));
 
-  boost::asio::async_write(client_socket, boost::asio::buffer(buffer, n),
-    boost::bind(&Connection::handle_write_response, shared_from_this(),
+  // headers and body blocks in one gathered write, body stays referenced until FinishResponse
+  std::vector<boost::asio::const_buffer> buffers;
+  buffers.push_back(boost::asio::const_buffer(buffer.data(), n));
+  AppendBlocks(body, offset, response_len, &buffers);
+  boost::asio::async_write(client_socket, buffers,
+    strand.wrap(boost::bind(&Connection::handle_write_response, shared_from_this(),
     boost::asio::placeholders::error,
-    boost::asio::placeholders::bytes_transferred));
+    boost::asio::placeholders::bytes_transferred)));
 }
 
 boost::asio::const_buffers_1 Connection::BuildChunk(size_t chunk_size) {
@@ -511,16 +1523,10 @@ boost::asio::const_buffers_1 Connection::BuildChunk(size_t chunk_size) {
 }
 void Connection::handle_write_response(boost::system::error_code const &ec, size_t bytes_transferred) {
   if (!ec) {
-    if (200 == status_code && !!image) {
-      size_t n = image->Read(buffer.data() + CHUNK_OFFSET, MAX_CHUNK_SIZE);
-      if (!n)
-        image.reset();
-      
-      boost::asio::async_write(client_socket, BuildChunk(n),
-        boost::bind(&Connection::handle_write_response, shared_from_this(),
-        boost::asio::placeholders::error,
-        boost::asio::placeholders::bytes_transferred));
-    }
+    if (status_stale)
+      RevalidateStatus();
+    else
+      FinishResponse();
   } else {
     cpcl::Trace(CPCL_TRACE_LEVEL_ERROR,
       "Connection(%08X)::handle_write_response() fails: %s",
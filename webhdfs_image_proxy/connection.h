@@ -7,6 +7,7 @@
 #include <boost/bind.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/array.hpp>
 
@@ -16,27 +17,56 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/placeholders.hpp>
 #include <boost/asio/read.hpp>
-// #include <boost/asio/strand.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/time_traits.hpp>
 #include <boost/asio/write.hpp>
 
-#include "task_pool.h"
-#include "image_cache.h"
+#include "proxy_context.h"
 #include "http_parse.hpp"
+#include "stream_pipe.h"
 
+#include <cpcl/dynamic_memory_stream.h>
+#include <cpcl/shared_buffer.h>
 #include <plcl/plugin_list.h>
 
 namespace net {
 
 class Connection : public boost::enable_shared_from_this<Connection>, private boost::noncopyable {
-  // boost::asio::io_service::strand strand;
+  boost::asio::io_service &io_service;
+  boost::asio::io_service::strand strand; // serializes all handlers of the connection, so request deadline may abort any phase
 
   // sockets for the connection.
   boost::asio::ip::tcp::socket client_socket;
-  boost::asio::ip::tcp::socket webhdfs_socket;
+  boost::asio::deadline_timer idle_timer; // closes client_socket if next request doesn't arrive in time
+  bool waiting_request; // idle_timer armed
+  bool keep_alive; // read next request after response sent
+  unsigned int requests_count; // responses sent on client_socket
+  bool reading; // async_read_some on client_socket in progress, at most one
+  bool processing; // request parsed, response not sent yet; client read only watches for eof
+  bool client_eof; // client shut down its send side(half-close) or failed while request processed, no more reads
+  bool closing; // last response sent, send side shut down, client reads only drained
+  CancelToken cancel_token; // set when client gone, expires at request deadline, polled by render worker
+  boost::asio::deadline_timer request_timer; // answers 504 if response not started before request deadline
+  bool responding; // response started, late webhdfs, flight and render completions ignored
+  UpstreamPool::Socket webhdfs_socket; // fresh or taken from context->upstream_pool
+  bool webhdfs_reused; // webhdfs_socket taken from pool, may be already closed by webhdfs
+  size_t webhdfs_received; // bytes of current webhdfs response
   
-  boost::asio::ip::tcp::resolver resolver;
-  std::string host, port;
+  DnsCache::Endpoints endpoints; // webhdfs host endpoints, tried in order
+  std::string namenode_host, namenode_port;
+  std::string host, port; // current webhdfs host, namenode or datanode from Location
+  bool location_cached; // host:port taken from context->locations, not from namenode response
+  size_t probe_length; // > 0 - ranged OPEN of leading bytes for ?info, download holds them
+  bool probed; // probe failed, whole file downloaded
+  bool stat_request; // webhdfs exchange is GETFILESTATUS, not OPEN
+  bool stat_leader; // connection leads SingleFlight context->stats for webhdfs_path
+  bool status_stale; // file_status expired: cached response served from it, refreshed before webhdfs fetch or after response
+  bool revalidating; // response sent from expired file_status, GETFILESTATUS refreshes it before next request
+  boost::shared_ptr<cpcl::DynamicMemoryStream> status_body; // GETFILESTATUS json
+  FileStatus file_status; // !file_status - unknown, no validators
+  std::string version; // "@mtime-length" appended to cache keys, so replaced file is not served from cache
+  std::string etag, last_modified; // validators of response, empty if file_status unknown
   
   boost::array<unsigned char, 0x1000> buffer;
   // BOOST_STATIC_CONSTANT(size_t, BUFFER_SIZE = 0x1000);
@@ -45,47 +75,127 @@ class Connection : public boost::enable_shared_from_this<Connection>, private bo
   static size_t const CHUNK_OFFSET = 6; // 4(chunk-size, FFFF) + 2(CRLF)
   static size_t const MAX_CHUNK_SIZE = 0x1000 - 8; // 4(chunk-size, FFFF) + 4(2 * CRLF)
   
+  // client requests, pipelined requests kept in request_buffer[request_head, request_tail) until current response sent
+  HttpParser request_parser;
+  boost::shared_ptr<cpcl::DynamicMemoryStream> request_body;
+  boost::array<unsigned char, 0x1000> request_buffer;
+  size_t request_head, request_tail;
+  size_t request_received; // bytes of current request
+
   // actual payload
-  HttpParser parser;
-  boost::shared_ptr<cpcl::IOStream> image;
-  std::string webhdfs_path, image_path;
+  HttpParser parser; // webhdfs response
+  boost::shared_ptr<cpcl::DynamicMemoryStream> download; // webhdfs response body
+  cpcl::SharedBuffer original; // downloaded or cached image, immutable
+  bool original_hit;
+  boost::shared_ptr<cpcl::DynamicMemoryStream> image; // rendered image
+  boost::shared_ptr<StreamPipe> stream; // image streamed to client while render worker encodes it
+  bool stream_writing; // async_write of stream headers or chunk in progress
+  bool stream_eof; // last chunk written
+  int stream_code; // render result, -1 while worker encodes
+  std::string webhdfs_path, image_path, render_key;
+  std::string image_key; // image_path && version, key of image_cache and fetches
+  cpcl::SharedBuffer body; // response body, rendered or cached, written straight from its memory blocks
+  bool body_hit;
+  bool fetch_leader, render_leader; // connection leads SingleFlight for image_path / render_key
   int status_code;
-  boost::shared_ptr<ImageCache> image_cache;
-  boost::shared_ptr<TaskPool> task_pool;
+  boost::shared_ptr<ProxyContext> context;
 
   plcl::PluginList *plugin_list;
-  unsigned int page_width, page_height, page_pixfmt;
   struct Query {
     cpcl::StringPiece request_path;
     unsigned int width, height;
     bool json;
+    unsigned int timeout; // milliseconds, zero means "not specified"
     
-    Query() : width(0), height(0), json(false)
+    Query() : width(0), height(0), json(false), timeout(0)
     {}
   } query;
   
-  // resolve && connect to webhdfs server
-  void handle_resolve(boost::system::error_code const &ec, boost::asio::ip::tcp::resolver::iterator endpoint_iterator);
-  void handle_connect(boost::system::error_code const &ec, boost::asio::ip::tcp::resolver::iterator endpoint_iterator);
+  // take idle socket from pool, otherwise resolve && connect to webhdfs server
+  void Connect();
+  void Resolve();
+  bool RetryRequest();
+  bool FallbackToNamenode();
+  void ReleaseSocket();
+  void WriteRequest();
+  void handle_resolve(boost::system::error_code const &ec, DnsCache::Endpoints const &v);
+  void handle_connect(boost::system::error_code const &ec, size_t endpoint_index);
 
   // handle completion of a read some date from a socket - i.e. handle_read will be called after some data readed from socket or error occurred.
   void handle_read_request(boost::system::error_code const &ec, size_t bytes_transferred);
+  void handle_idle_timeout(boost::system::error_code const &ec);
+  void handle_request_timeout(boost::system::error_code const &ec);
+  void ReadRequest();
+  void ReadClient();
+  void CancelRender();
+  void CloseClient();
+  void ParseRequest(bool eof);
+  void StopWaiting();
+  void HandleRequest();
+  void HandlePrewarm();
+  void StartDeadline();
+  // GETFILESTATUS before render lookup, gives validators and version of cache keys
+  void StatFile();
+  void RevalidateStatus();
+  void handle_read_status(boost::system::error_code const &ec, size_t bytes_transferred);
+  void HandleStatus(int code);
+  void ApplyStatus(int code, cpcl::SharedBuffer const &json);
+  void PostStatFlight(unsigned int request, int code, cpcl::SharedBuffer const &v);
+  void handle_stat_flight(unsigned int request, int code, cpcl::SharedBuffer v);
+  void CompleteStat(int code, cpcl::SharedBuffer const &json);
+  void SetValidators();
+  bool NotModified();
+  bool RangeApplies();
+  void LookupRender();
+  void JoinRender();
+  void UpstreamFailed();
+  void HandleProbe();
+  void FinishResponse();
+  void ResetRequest();
   void handle_read_webhdfs_response(boost::system::error_code const &ec, size_t bytes_transferred);
 
   // the handler to be called when the write operation completes - i.e. the bytes transferred is equal to the sum of the buffer sizes or error occurred.
   void handle_write_request(boost::system::error_code const &ec, size_t bytes_transferred);
   void handle_write_response(boost::system::error_code const &ec, size_t bytes_transferred);
 
+  // completion of the same fetch / render led by another connection
+  // request - requests_count when joined, flight may complete after request answered 504
+  void handle_fetch_flight(unsigned int request, int code, cpcl::SharedBuffer v);
+  void handle_render_flight(unsigned int request, int code, cpcl::SharedBuffer v);
+  void PostFetchFlight(unsigned int request, int code, cpcl::SharedBuffer const &v);
+  void PostRenderFlight(unsigned int request, int code, cpcl::SharedBuffer const &v);
+  // disk_cache lookup completed on its reader thread, v empty - miss
+  void PostDiskOriginal(unsigned int request, cpcl::SharedBuffer const &v);
+  void PostDiskRender(unsigned int request, cpcl::SharedBuffer const &v);
+  void handle_disk_original(unsigned int request, cpcl::SharedBuffer v);
+  void handle_disk_render(unsigned int request, cpcl::SharedBuffer v);
+  void CompleteFetch(int code);
+  void CompleteRender(int code);
+  // decoded original / rendered body to image_cache / render_cache and disk_cache
+  void PutOriginal();
+  void PutRender();
+
   Query GetQuery(std::string const &uri);
+  static std::string RenderKey(std::string const &path, Query const &query);
   size_t BuildRequest(std::string const &request_path);
   void SendRequest(std::string const &request_path);
+  void FetchOriginal();
   bool SetLocation(cpcl::StringPiece const &uri);
   void SendPage();
-  size_t BuildResponse(int code, size_t response_len);
+  void handle_render_complete(CancelToken const &token, int code);
+  // chunks of streamed render sent as soon as worker writes them
+  static void NotifyStream(boost::weak_ptr<Connection> const &connection);
+  void WriteStream();
+  void CompleteStream(int code);
+  void AbortStream();
+  void handle_write_stream(boost::system::error_code const &ec, size_t bytes_transferred);
+  void SendResponse(int code);
+  /* response_len bytes of body at offset, total - body size for Content-Range */
+  size_t BuildResponse(int code, size_t offset, size_t response_len, size_t total);
   boost::asio::const_buffers_1 BuildChunk(size_t chunk_size);
   void SendChunk(unsigned char *chunk, size_t chunk_size);
 public:
-  Connection(boost::asio::io_service &io_service, boost::shared_ptr<ImageCache> image_cache, boost::shared_ptr<TaskPool> task_pool, std::string host, std::string port, plcl::PluginList *plugin_list);
+  Connection(boost::asio::io_service &io_service, boost::shared_ptr<ProxyContext> context, std::string host, std::string port, plcl::PluginList *plugin_list);
   ~Connection();
 
   // get the socket associated with the in connection.
@@ -93,7 +203,8 @@ public:
 
   // start the first asynchronous operation for the connection.
   void Start();
-  void SendResponse(int code);
+  /* called by render worker, token identifies request the task was queued for */
+  void RenderComplete(CancelToken const &token, int code);
 };
 
 } // namespace net
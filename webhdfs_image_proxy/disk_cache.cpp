@@ -0,0 +1,481 @@
+﻿#include <cpcl/basic.h>
+
+#include <string.h> // memcpy, memcmp
+
+#include <algorithm>
+#include <memory> // std::auto_ptr
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <cpcl/file_stream.h>
+#include <cpcl/file_iterator.h>
+#include <cpcl/file_mapping.h>
+#include <cpcl/file_util.h>
+#include <cpcl/memory_storage.h>
+#include <cpcl/string_util.hpp>
+#include <cpcl/trace.h>
+
+#include "disk_cache.h"
+
+using cpcl::uint32;
+using cpcl::uint64;
+
+namespace {
+
+struct FileHeader {
+  char magic[4];
+  uint32 key_size;
+  uint64 data_size;
+};
+char const kMagic[4] = { 'I', 'P', 'D', '1' };
+char const kExtension[] = ".ipd";
+// snapshots: magic, then (hash, size) pairs oldest first / (key size, key) hottest first
+char const kIndexMagic[4] = { 'I', 'P', 'X', '1' };
+char const kHotMagic[4] = { 'I', 'P', 'H', '1' };
+char const kIndexSnapshot[] = "index.snapshot";
+char const kHotSnapshot[] = "hot.snapshot";
+
+struct ScannedFile {
+  cpcl::int64 mtime;
+  uint64 hash, size;
+
+  bool operator<(ScannedFile const &v) const { return mtime < v.mtime; }
+};
+
+// touch every page of view, so reader thread takes page faults instead of writev on io thread
+unsigned char Prefault(unsigned char const *p, size_t size) {
+  unsigned char r(0);
+  for (size_t i = 0; i < size; i += 0x1000)
+    r ^= static_cast<unsigned char const volatile*>(p)[i];
+  return r;
+}
+
+// options give narrow path, windows api wants wide one(ascii assumed, as for command line)
+inline std::basic_string<FilePathChar> OsPath(std::string const &s) {
+  return std::basic_string<FilePathChar>(s.begin(), s.end());
+}
+
+} // namespace
+
+DiskCache::DiskCache(std::string const &dir, uint64 bytes_cap, size_t queue_cap)
+  : dir(dir), bytes_cap(bytes_cap), bytes(0), queue_cap(queue_cap), exit_requested(false),
+  hits(0), misses(0), writes(0), dropped(0), evictions(0)
+{}
+DiskCache::~DiskCache() {
+  Stop();
+}
+
+bool DiskCache::Start(Prefetch const &prefetch) {
+  if (dir.empty() || !!writer)
+    return false;
+  this->prefetch = prefetch;
+  if (!cpcl::CreateDirectoryPath(OsPath(dir).c_str())) {
+    dir.clear();
+    return false;
+  }
+  writer.reset(new boost::thread(boost::bind(&DiskCache::WriterThread, this)));
+  reader.reset(new boost::thread(boost::bind(&DiskCache::ReaderThread, this)));
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO, "DiskCache::Start(): %s, %llu MB",
+    dir.c_str(), (unsigned long long)(bytes_cap >> 20));
+  return true;
+}
+
+void DiskCache::Stop() {
+  if (!writer)
+    return;
+  {
+    scoped_lock lock(mutex);
+    exit_requested = true;
+  }
+  cv.notify_all();
+  read_cv.notify_all();
+  if (writer->joinable())
+    writer->join();
+  writer.reset();
+  if (reader->joinable())
+    reader->join();
+  reader.reset();
+}
+
+/* FNV-1a, then murmur3 finalizer */
+DiskCache::Hash DiskCache::HashOf(std::string const &key) {
+  Hash h(14695981039346656037ULL);
+  for (std::string::const_iterator it = key.begin(); it != key.end(); ++it)
+    h = (h ^ (unsigned char)*it) * 1099511628211ULL;
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+DiskCache::Path DiskCache::FilePath(Hash hash) const {
+  char buf[0x20];
+  size_t const n = cpcl::StringFormat(buf, "/%016llx%s", (unsigned long long)hash, kExtension);
+  return OsPath(dir + std::string(buf, n));
+}
+
+DiskCache::Path DiskCache::SnapshotPath(char const *name) const {
+  return OsPath(dir + "/" + name);
+}
+
+bool DiskCache::Get(std::string const &key, cpcl::SharedBuffer *v) {
+  if (dir.empty())
+    return false;
+  Hash const hash = HashOf(key);
+  {
+    scoped_lock lock(mutex);
+    Index::iterator it = index.find(hash);
+    if (index.end() == it) {
+      ++misses;
+      return false;
+    }
+    order.splice(order.end(), order, it->second.order);
+  }
+
+  Path const path = FilePath(hash);
+  cpcl::FileMapping *mapping_;
+  if (!cpcl::FileMapping::Map(path.c_str(), &mapping_)) {
+    bool is_directory;
+    if (!cpcl::ExistFilePath(path.c_str(), &is_directory)) { // evicted after index lookup, or removed while snapshot was on disk
+      scoped_lock lock(mutex);
+      Index::iterator it = index.find(hash);
+      if (it != index.end()) {
+        bytes -= it->second.size;
+        order.erase(it->second.order);
+        index.erase(it);
+      }
+    }
+    ++misses;
+    return false;
+  }
+  boost::shared_ptr<cpcl::FileMapping> mapping(mapping_); // SharedBuffer storage keeps it
+
+  unsigned char const *p = mapping->Data();
+  FileHeader header;
+  if (mapping->Size() <= sizeof(header)) {
+    ++misses;
+    return false;
+  }
+  ::memcpy(&header, p, sizeof(header));
+  if (::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || !header.data_size
+    || sizeof(header) + (uint64)header.key_size + header.data_size != (uint64)mapping->Size()
+    || header.key_size != key.size() || ::memcmp(p + sizeof(header), key.data(), key.size()) != 0) {
+    ++misses; // hash collision or foreign file
+    return false;
+  }
+  mapping->WillNeed();
+  Prefault(p, mapping->Size());
+  size_t const size = (size_t)header.data_size;
+  *v = cpcl::SharedBuffer(boost::shared_ptr<cpcl::MemoryStorage const>(
+    new cpcl::MemoryStorage(const_cast<unsigned char*>(p) + sizeof(header) + header.key_size, size, mapping)), size);
+  ++hits;
+  return true;
+}
+
+bool DiskCache::AsyncGet(std::string const &key, Callback const &callback) {
+  if (dir.empty())
+    return false;
+  {
+    scoped_lock lock(mutex);
+    if (!reader || exit_requested || index.find(HashOf(key)) == index.end()) {
+      ++misses;
+      return false;
+    }
+    reads.push_back(std::make_pair(key, callback));
+  }
+  read_cv.notify_one();
+  return true;
+}
+
+void DiskCache::Put(std::string const &key, cpcl::SharedBuffer const &v) {
+  if (dir.empty() || !v || !v.Size())
+    return;
+  {
+    scoped_lock lock(mutex);
+    if (index.find(HashOf(key)) != index.end())
+      return; // keys are versioned, data of key never changes
+    if (queue.size() >= queue_cap) {
+      ++dropped;
+      return;
+    }
+    queue.push_back(std::make_pair(key, v));
+  }
+  cv.notify_one();
+}
+
+void DiskCache::WriterThread() {
+  if (!LoadIndex())
+    Scan();
+  PrefetchHotKeys();
+  for (;;) {
+    std::pair<std::string, cpcl::SharedBuffer> item;
+    {
+      scoped_lock lock(mutex);
+      while (queue.empty() && !exit_requested)
+        cv.wait(lock);
+      if (queue.empty())
+        break;
+      item = queue.front();
+      queue.pop_front();
+    }
+    uint64 size;
+    if (Write(item.first, item.second, &size)) {
+      ++writes;
+      Insert(HashOf(item.first), size);
+    }
+  }
+}
+
+/* queued reads served before exit, so callbacks always called */
+void DiskCache::ReaderThread() {
+  for (;;) {
+    std::pair<std::string, Callback> item;
+    {
+      scoped_lock lock(mutex);
+      while (reads.empty() && !exit_requested)
+        read_cv.wait(lock);
+      if (reads.empty())
+        break;
+      item = reads.front();
+      reads.pop_front();
+    }
+    cpcl::SharedBuffer v;
+    Get(item.first, &v);
+    item.second(v);
+  }
+}
+
+/* files left by previous run, *.tmp of interrupted writes removed */
+void DiskCache::Scan() {
+  std::vector<ScannedFile> files;
+  Path const dir_path = OsPath(dir);
+  cpcl::FileIterator it(dir_path);
+  cpcl::FileIterator::FileInfo info;
+  while (it.Next(&info)) {
+    if (!info.Normal())
+      continue;
+    Path const path = info.file_path.as_string();
+    cpcl::BasicStringPiece<FilePathChar> const file_name = cpcl::FileName(info.file_path);
+    std::string const name_(file_name.begin(), file_name.end()); // names of cache files are ascii
+    cpcl::StringPiece const name(name_);
+    if (name.ends_with(cpcl::StringPieceFromLiteral(".tmp"))) {
+      cpcl::RemoveFilePath(path.c_str());
+      continue;
+    }
+    if (name.size() != 16 + arraysize(kExtension) - 1 || !name.ends_with(cpcl::StringPiece(kExtension)))
+      continue;
+    ScannedFile file;
+    file.hash = 0;
+    bool valid(true);
+    for (size_t i = 0; i < 16 && valid; ++i) {
+      char const c = name[i];
+      if (c >= '0' && c <= '9')
+        file.hash = (file.hash << 4) | (uint64)(c - '0');
+      else if (c >= 'a' && c <= 'f')
+        file.hash = (file.hash << 4) | (uint64)(c - 'a' + 10);
+      else
+        valid = false;
+    }
+    if (!valid || !cpcl::GetFileSizeAndTime(path.c_str(), &file.size, &file.mtime))
+      continue;
+    files.push_back(file);
+  }
+  std::sort(files.begin(), files.end());
+  for (std::vector<ScannedFile>::const_iterator i = files.begin(); i != files.end(); ++i)
+    Insert(i->hash, i->size);
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO, "DiskCache::Scan(): %u files indexed", (unsigned int)files.size());
+}
+
+bool DiskCache::LoadIndex() {
+  std::string data;
+  if (!ReadSnapshot(kIndexSnapshot, &data))
+    return false;
+  cpcl::RemoveFilePath(SnapshotPath(kIndexSnapshot).c_str()); // files change from now on
+  if (data.size() < sizeof(kIndexMagic) || ::memcmp(data.data(), kIndexMagic, sizeof(kIndexMagic)) != 0
+    || (data.size() - sizeof(kIndexMagic)) % (2 * sizeof(uint64)) != 0) {
+    cpcl::Error(cpcl::StringPieceFromLiteral("DiskCache::LoadIndex(): invalid index snapshot"));
+    return false;
+  }
+  size_t n(0);
+  for (size_t i = sizeof(kIndexMagic); i < data.size(); i += 2 * sizeof(uint64), ++n) {
+    uint64 hash, size;
+    ::memcpy(&hash, data.data() + i, sizeof(hash));
+    ::memcpy(&size, data.data() + i + sizeof(hash), sizeof(size));
+    Insert(hash, size);
+  }
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO, "DiskCache::LoadIndex(): %u files indexed from snapshot", (unsigned int)n);
+  return true;
+}
+
+/* hot keys of the last run, hottest first, loaded from disk to memory caches */
+void DiskCache::PrefetchHotKeys() {
+  std::string data;
+  if (!ReadSnapshot(kHotSnapshot, &data))
+    return;
+  cpcl::RemoveFilePath(SnapshotPath(kHotSnapshot).c_str());
+  if (!prefetch || data.size() < sizeof(kHotMagic) || ::memcmp(data.data(), kHotMagic, sizeof(kHotMagic)) != 0)
+    return;
+  size_t n(0), loaded(0);
+  for (size_t i = sizeof(kHotMagic); i + sizeof(uint32) <= data.size(); ++n) {
+    {
+      scoped_lock lock(mutex);
+      if (exit_requested)
+        break;
+    }
+    uint32 key_size;
+    ::memcpy(&key_size, data.data() + i, sizeof(key_size));
+    i += sizeof(key_size);
+    if (key_size > data.size() - i)
+      break;
+    std::string const key(data.data() + i, key_size);
+    i += key_size;
+    cpcl::SharedBuffer v;
+    if (Get(key, &v)) {
+      prefetch(key, v);
+      ++loaded;
+    }
+  }
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO, "DiskCache::PrefetchHotKeys(): %u of %u hot keys loaded", (unsigned int)loaded, (unsigned int)n);
+}
+
+bool DiskCache::Save(std::vector<std::string> const &hot_keys) {
+  if (dir.empty() || !!writer)
+    return false;
+  std::string index_data(kIndexMagic, sizeof(kIndexMagic)), hot_data(kHotMagic, sizeof(kHotMagic));
+  {
+    scoped_lock lock(mutex);
+    index_data.reserve(index_data.size() + order.size() * 2 * sizeof(uint64));
+    for (Order::const_iterator it = order.begin(); it != order.end(); ++it) {
+      uint64 const size = index.find(*it)->second.size;
+      index_data.append(reinterpret_cast<char const*>(&*it), sizeof(uint64));
+      index_data.append(reinterpret_cast<char const*>(&size), sizeof(size));
+    }
+  }
+  for (std::vector<std::string>::const_iterator it = hot_keys.begin(); it != hot_keys.end(); ++it) {
+    uint32 const key_size = (uint32)it->size();
+    hot_data.append(reinterpret_cast<char const*>(&key_size), sizeof(key_size));
+    hot_data.append(*it);
+  }
+  if (!WriteSnapshot(kIndexSnapshot, index_data) || !WriteSnapshot(kHotSnapshot, hot_data))
+    return false;
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO, "DiskCache::Save(): %u files, %u hot keys",
+    (unsigned int)((index_data.size() - sizeof(kIndexMagic)) / (2 * sizeof(uint64))), (unsigned int)hot_keys.size());
+  return true;
+}
+
+bool DiskCache::ReadSnapshot(char const *name, std::string *data) {
+  Path const path = SnapshotPath(name);
+  bool is_directory;
+  if (!cpcl::ExistFilePath(path.c_str(), &is_directory))
+    return false; // no snapshot, not an error
+  cpcl::FileStream *file_;
+  if (!cpcl::FileStream::Read(path.c_str(), &file_))
+    return false;
+  std::auto_ptr<cpcl::FileStream> file(file_);
+  cpcl::int64 const size = file->Size();
+  if (size <= 0)
+    return false;
+  data->resize((size_t)size);
+  return file->Read(&(*data)[0], (uint32)size) == (uint32)size;
+}
+
+/* .tmp then rename, so next Start reads either complete snapshot or none */
+bool DiskCache::WriteSnapshot(char const *name, std::string const &data) {
+  Path const path = SnapshotPath(name), tmp = SnapshotPath((std::string(name) + ".tmp").c_str());
+  cpcl::RemoveFilePath(tmp.c_str());
+  cpcl::FileStream *file_;
+  if (!cpcl::FileStream::Create(tmp.c_str(), &file_))
+    return false;
+  std::auto_ptr<cpcl::FileStream> file(file_);
+  bool r = file->Write(data.data(), (uint32)data.size()) == data.size();
+  file.reset();
+  if (r)
+    r = cpcl::RenameFilePath(tmp.c_str(), path.c_str());
+  if (!r)
+    cpcl::RemoveFilePath(tmp.c_str());
+  return r;
+}
+
+bool DiskCache::Write(std::string const &key, cpcl::SharedBuffer const &v, uint64 *size) {
+  Path const path = FilePath(HashOf(key)), tmp = path + OsPath(".tmp");
+  cpcl::RemoveFilePath(tmp.c_str());
+  cpcl::FileStream *file_;
+  if (!cpcl::FileStream::Create(tmp.c_str(), &file_))
+    return false;
+  std::auto_ptr<cpcl::FileStream> file(file_);
+
+  FileHeader header;
+  ::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.key_size = (uint32)key.size();
+  header.data_size = v.Size();
+  bool r = file->Write(&header, sizeof(header)) == sizeof(header)
+    && file->Write(key.data(), (uint32)key.size()) == key.size();
+  for (size_t offset = 0; r && offset < v.Size();) {
+    std::pair<unsigned char const*, size_t> block = v.Block(offset);
+    r = file->Write(block.first, (uint32)block.second) == block.second;
+    offset += block.second;
+  }
+  file.reset();
+  if (r)
+    r = cpcl::RenameFilePath(tmp.c_str(), path.c_str());
+  if (!r) {
+    cpcl::RemoveFilePath(tmp.c_str());
+    return false;
+  }
+  *size = sizeof(header) + key.size() + v.Size();
+  return true;
+}
+
+void DiskCache::Insert(Hash hash, uint64 size) {
+  std::vector<Hash> evicted;
+  {
+    scoped_lock lock(mutex);
+    std::pair<Index::iterator, bool> it = index.insert(Index::value_type(hash, Entry()));
+    Entry &entry = it.first->second;
+    if (it.second) {
+      entry.order = order.insert(order.end(), hash);
+    } else {
+      bytes -= entry.size;
+      order.splice(order.end(), order, entry.order);
+    }
+    entry.size = size;
+    bytes += size;
+
+    while (bytes > bytes_cap && order.size() > 1) {
+      Index::iterator const oldest = index.find(order.front());
+      bytes -= oldest->second.size;
+      evicted.push_back(oldest->first);
+      index.erase(oldest);
+      order.pop_front();
+    }
+  }
+  for (std::vector<Hash>::const_iterator i = evicted.begin(); i != evicted.end(); ++i) {
+    cpcl::RemoveFilePath(FilePath(*i).c_str()); // mapped file stays readable until unmapped
+    ++evictions;
+  }
+}
+
+DiskCache::Stats DiskCache::GetStats() {
+  scoped_lock lock(mutex);
+  Stats r = { index.size(), bytes };
+  return r;
+}
+
+void DiskCache::State() {
+  size_t n, queued;
+  uint64 b;
+  {
+    scoped_lock lock(mutex);
+    n = index.size();
+    queued = queue.size();
+    b = bytes;
+  }
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO,
+    "DiskCache::State(): items %u, %llu/%llu MB, queued %u, hits %lu, misses %lu, writes %lu, dropped %lu, evictions %lu",
+    (unsigned int)n, (unsigned long long)(b >> 20), (unsigned long long)(bytes_cap >> 20), (unsigned int)queued,
+    hits.load(), misses.load(), writes.load(), dropped.load(), evictions.load());
+}
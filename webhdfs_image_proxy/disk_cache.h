@@ -0,0 +1,111 @@
+﻿// disk_cache.h
+#pragma once
+
+#ifndef __DISK_CACHE_H
+#define __DISK_CACHE_H
+
+#include <string>
+#include <list>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/atomic.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <cpcl/basic.h>
+#include <cpcl/shared_buffer.h>
+
+/*
+ * second tier of image_cache and render_cache on local disk, survives restart
+ * every entry is file <dir>/<16 hex digits of key hash>.ipd: 16 bytes header(magic, key size, data size), key, data
+ * file operations through cpcl(FileStream, FileMapping, file_util), so no platform code here
+ * Put only queues entry, writer thread writes it with cpcl::FileStream to .tmp file and renames it,
+ * so readers never see partial file, full queue drops entry
+ * Get maps file and returns SharedBuffer over the mapping, file may be unlinked while buffer is used,
+ * key stored in file compared, hash collision is a miss
+ * AsyncGet - Get on reader thread, pages of the file faulted in there, so io threads never block on disk;
+ * index checked right away, miss answered without queueing
+ * index - hash -> file size in least recently used order, evicted files unlinked when bytes_cap exceeded
+ * on Start writer thread first indexes files already in dir, oldest modification time evicted first
+ * warm restart: Save after Stop writes index snapshot and hot keys to dir, next Start loads index from snapshot
+ * instead of scanning dir, then passes hot keys found on disk to prefetch, all before queued writes,
+ * so startup doesn't wait for it; snapshot removed once loaded, after crash dir scanned again
+ */
+class DiskCache {
+public:
+  typedef boost::function<void (std::string const &key, cpcl::SharedBuffer const &v)> Prefetch;
+  typedef boost::function<void (cpcl::SharedBuffer const &v)> Callback; // empty v - miss
+  struct Stats {
+    size_t items;
+    cpcl::uint64 bytes;
+  };
+
+  /* dir empty - cache disabled */
+  DiskCache(std::string const &dir, cpcl::uint64 bytes_cap, size_t queue_cap);
+  ~DiskCache();
+
+  /* prefetch called from writer thread, may be empty */
+  bool Start(Prefetch const &prefetch = Prefetch());
+  /* queued entries written before writer thread exits */
+  void Stop();
+  /* after Stop, hot_keys - hottest first */
+  bool Save(std::vector<std::string> const &hot_keys);
+
+  bool Get(std::string const &key, cpcl::SharedBuffer *v);
+  /* false - key not indexed, callback not called; true - callback called from reader thread, hit or miss */
+  bool AsyncGet(std::string const &key, Callback const &callback);
+  void Put(std::string const &key, cpcl::SharedBuffer const &v);
+
+  Stats GetStats();
+  void State();
+private:
+  typedef cpcl::uint64 Hash;
+  typedef std::basic_string<FilePathChar> Path;
+  typedef std::list<Hash> Order; // front - least recently used
+  struct Entry {
+    cpcl::uint64 size;
+    Order::iterator order;
+  };
+  typedef boost::unordered_map<Hash, Entry> Index;
+  typedef std::deque<std::pair<std::string, cpcl::SharedBuffer> > Queue;
+  typedef std::deque<std::pair<std::string, Callback> > Reads;
+  typedef boost::unique_lock<boost::mutex> scoped_lock;
+
+  std::string dir;
+  cpcl::uint64 bytes_cap, bytes;
+  size_t queue_cap;
+  Index index;
+  Order order;
+  Queue queue;
+  Reads reads;
+  bool exit_requested;
+  Prefetch prefetch;
+  boost::shared_ptr<boost::thread> writer, reader;
+  boost::atomic<unsigned long> hits, misses, writes, dropped, evictions;
+  boost::mutex mutex;
+  boost::condition_variable cv, read_cv;
+
+  static Hash HashOf(std::string const &key);
+  Path FilePath(Hash hash) const;
+  Path SnapshotPath(char const *name) const;
+  void WriterThread();
+  void ReaderThread();
+  void Scan();
+  bool LoadIndex();
+  void PrefetchHotKeys();
+  bool ReadSnapshot(char const *name, std::string *data);
+  bool WriteSnapshot(char const *name, std::string const &data);
+  bool Write(std::string const &key, cpcl::SharedBuffer const &v, cpcl::uint64 *size);
+  /* add entry, unlink least recently used files over bytes_cap */
+  void Insert(Hash hash, cpcl::uint64 size);
+
+  DISALLOW_COPY_AND_ASSIGN(DiskCache);
+};
+
+#endif // __DISK_CACHE_H
@@ -0,0 +1,117 @@
+﻿#include <cpcl/basic.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cpcl/trace.h>
+
+#include "dns_cache.h"
+
+namespace ip = boost::asio::ip;
+namespace pt = boost::posix_time;
+
+DnsCache::DnsCache(boost::asio::io_service &io_service, unsigned int ttl, unsigned int negative_ttl)
+  : io_service(io_service), ttl(pt::seconds(ttl)), negative_ttl(pt::seconds(negative_ttl)),
+  hits(0), stale_hits(0), misses(0), failures(0)
+{}
+
+void DnsCache::Resolve(std::string const &host, std::string const &port, Callback const &callback) {
+  pt::ptime const now = pt::microsec_clock::universal_time();
+  std::string const k = host + ":" + port;
+  Endpoints endpoints;
+  boost::system::error_code ec;
+  {
+    scoped_lock lock(mutex);
+    Entry &entry = entries[k];
+    bool const fresh = !entry.expires.is_not_a_date_time() && now < entry.expires;
+    if (!entry.endpoints.empty()) {
+      endpoints = entry.endpoints;
+      if (fresh)
+        ++hits;
+      else {
+        ++stale_hits;
+        if (!entry.resolving) {
+          entry.resolving = true;
+          StartResolve(k, host, port);
+        }
+      }
+    } else if (fresh && !!entry.ec) {
+      ec = entry.ec; // negative hit
+      ++hits;
+    } else {
+      ++misses;
+      entry.waiters.push_back(callback);
+      if (!entry.resolving) {
+        entry.resolving = true;
+        StartResolve(k, host, port);
+      }
+      return;
+    }
+  }
+  callback(ec, endpoints);
+}
+
+void DnsCache::StartResolve(std::string const &k, std::string const &host, std::string const &port) {
+  Resolver resolver(new ip::tcp::resolver(io_service));
+  ip::tcp::resolver::query query(host, port, ip::resolver_query_base::v4_mapped |
+    /*ip::resolver_query_base::numeric_host |*/ ip::resolver_query_base::numeric_service);
+  resolver->async_resolve(query,
+    boost::bind(&DnsCache::handle_resolve, this, k, resolver,
+    boost::asio::placeholders::error,
+    boost::asio::placeholders::iterator));
+}
+
+void DnsCache::handle_resolve(std::string const &k, Resolver /*resolver, bound to keep it alive*/,
+  boost::system::error_code const &ec, ip::tcp::resolver::iterator it) {
+  pt::ptime const now = pt::microsec_clock::universal_time();
+  Endpoints endpoints;
+  if (!ec) {
+    for (ip::tcp::resolver::iterator tail; it != tail; ++it)
+      endpoints.push_back(*it);
+  }
+
+  std::vector<Callback> waiters;
+  boost::system::error_code r = ec;
+  if (!r && endpoints.empty())
+    r = boost::asio::error::host_not_found;
+  {
+    scoped_lock lock(mutex);
+    Entry &entry = entries[k];
+    entry.resolving = false;
+    if (!r) {
+      entry.endpoints = endpoints;
+      entry.ec = boost::system::error_code();
+      entry.expires = now + ttl;
+    } else {
+      ++failures;
+      // keep stale endpoints if any, retry resolve after negative_ttl
+      entry.ec = r;
+      entry.expires = now + negative_ttl;
+      endpoints = entry.endpoints;
+      if (!endpoints.empty())
+        r = boost::system::error_code();
+    }
+    waiters.swap(entry.waiters);
+  }
+  if (!!ec) {
+    cpcl::Trace(CPCL_TRACE_LEVEL_WARNING,
+      "DnsCache::handle_resolve(): \"%s\" fails: %s",
+      k.c_str(), ec.message().c_str());
+  }
+
+  for (std::vector<Callback>::iterator it = waiters.begin(), tail = waiters.end(); it != tail; ++it)
+    (*it)(r, endpoints);
+}
+
+void DnsCache::State() {
+  size_t n;
+  {
+    scoped_lock lock(mutex);
+    n = entries.size();
+  }
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO,
+    "DnsCache::State(): %u hosts, hits %lu, stale hits %lu, misses %lu, failures %lu",
+    (unsigned int)n, hits.load(), stale_hits.load(), misses.load(), failures.load());
+}
@@ -0,0 +1,64 @@
+﻿// dns_cache.h
+#pragma once
+
+#ifndef __DNS_CACHE_H
+#define __DNS_CACHE_H
+
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+/*
+ * resolved endpoints of webhdfs hosts, shared by all connections, keyed by "host:port"
+ * fresh entry returned without resolve
+ * expired entry with endpoints returned as is, while single background resolve refreshes it(stale while refresh)
+ * failed resolve cached for negative_ttl, so unknown host doesn't cost getaddrinfo per request
+ * concurrent lookups of the same missed key wait for one resolve
+ * callback invoked outside the lock, either before Resolve returns(hit) or on io_service thread
+ */
+class DnsCache {
+public:
+  typedef std::vector<boost::asio::ip::tcp::endpoint> Endpoints;
+  typedef boost::function<void(boost::system::error_code const&, Endpoints const&)> Callback;
+
+  DnsCache(boost::asio::io_service &io_service, unsigned int ttl, unsigned int negative_ttl);
+
+  void Resolve(std::string const &host, std::string const &port, Callback const &callback);
+  void State();
+private:
+  struct Entry {
+    Endpoints endpoints;
+    boost::system::error_code ec; // last resolve error, endpoints empty
+    boost::posix_time::ptime expires;
+    bool resolving;
+    std::vector<Callback> waiters;
+
+    Entry() : resolving(false)
+    {}
+  };
+  typedef boost::unordered_map<std::string, Entry> Entries;
+  typedef boost::unique_lock<boost::mutex> scoped_lock;
+  typedef boost::shared_ptr<boost::asio::ip::tcp::resolver> Resolver;
+
+  boost::asio::io_service &io_service;
+  boost::posix_time::time_duration ttl, negative_ttl;
+  Entries entries;
+  boost::atomic<unsigned long> hits, stale_hits, misses, failures;
+  boost::mutex mutex;
+
+  void StartResolve(std::string const &k, std::string const &host, std::string const &port);
+  void handle_resolve(std::string const &k, Resolver resolver,
+    boost::system::error_code const &ec, boost::asio::ip::tcp::resolver::iterator it);
+
+  DISALLOW_COPY_AND_ASSIGN(DnsCache);
+};
+
+#endif // __DNS_CACHE_H
@@ -0,0 +1,71 @@
+﻿#include <cpcl/basic.h>
+
+#include <boost/thread/locks.hpp>
+
+#include <cpcl/io_stream.h>
+#include <cpcl/trace.h>
+#include <plcl/plugin_list.h>
+
+#include "doc_cache.h"
+
+DocCache::DocCache(size_t items_cap, size_t bytes_cap)
+  : items_cap(items_cap), bytes_cap(bytes_cap), bytes(0), hits(0), misses(0), evictions(0)
+{}
+DocCache::~DocCache()
+{}
+
+bool DocCache::Acquire(std::string const &key, Item *item) {
+  {
+    scoped_lock lock(mutex);
+    Index::iterator it = index.find(key);
+    if (it != index.end()) {
+      *item = it->second->second;
+      bytes -= item->cost;
+      order.erase(it->second);
+      index.erase(it);
+      ++hits;
+      return true;
+    }
+  }
+  ++misses;
+  return false;
+}
+
+void DocCache::Release(std::string const &key, Item const &item) {
+  if (!items_cap || !bytes_cap || item.cost > bytes_cap || !item.doc)
+    return;
+  std::vector<Item> evicted; // Doc destructor may be heavy, run it after unlock
+  {
+    scoped_lock lock(mutex);
+    index.insert(Index::value_type(key, order.insert(order.end(), std::make_pair(key, item))));
+    bytes += item.cost;
+
+    while (order.size() > items_cap || bytes > bytes_cap) {
+      Order::iterator const oldest = order.begin();
+      std::pair<Index::iterator, Index::iterator> range = index.equal_range(oldest->first);
+      for (Index::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == oldest) {
+          index.erase(it);
+          break;
+        }
+      }
+      bytes -= oldest->second.cost;
+      evicted.push_back(oldest->second);
+      order.erase(oldest);
+      ++evictions;
+    }
+  }
+}
+
+void DocCache::State() {
+  size_t n, b;
+  {
+    scoped_lock lock(mutex);
+    n = order.size();
+    b = bytes;
+  }
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO,
+    "DocCache::State(): items %u/%u, bytes %u/%u, hits %lu, misses %lu, evictions %lu",
+    (unsigned int)n, (unsigned int)items_cap, (unsigned int)b, (unsigned int)bytes_cap,
+    hits.load(), misses.load(), evictions.load());
+}
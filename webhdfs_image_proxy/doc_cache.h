@@ -0,0 +1,71 @@
+﻿// doc_cache.h
+#pragma once
+
+#ifndef __DOC_CACHE_H
+#define __DOC_CACHE_H
+
+#include <string>
+#include <list>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cpcl/basic.h>
+
+namespace plcl {
+class Doc;
+}
+namespace cpcl {
+class IOStream;
+}
+
+/*
+ * loaded plcl::Doc objects idle between renders, keyed by webhdfs path && version like image_cache
+ * so renders of other sizes from the same original skip LoadDoc
+ * doc is not shared by workers: Acquire takes idle doc out of cache, worker owns it while it renders,
+ * Release returns it, several docs of one key may be idle if several workers rendered it at once
+ * doc keeps stream it was loaded from, it may read the original lazily
+ * cost estimated by caller(original size + decoded page bytes), least recently released docs
+ * destroyed when items_cap or bytes_cap exceeded, outside of mutex
+ */
+class DocCache {
+public:
+  struct Item {
+    boost::shared_ptr<cpcl::IOStream> in;
+    boost::shared_ptr<plcl::Doc> doc;
+    unsigned int page_width, page_height; // page 0 before scaling, render changes page size
+    size_t cost;
+
+    Item() : page_width(0), page_height(0), cost(0)
+    {}
+  };
+
+  /* items_cap == 0 or bytes_cap == 0 - cache disabled */
+  DocCache(size_t items_cap, size_t bytes_cap);
+  ~DocCache();
+
+  /* idle doc of key removed from cache, caller owns it until Release */
+  bool Acquire(std::string const &key, Item *item);
+  /* doc must not be used by caller after Release */
+  void Release(std::string const &key, Item const &item);
+
+  void State();
+private:
+  typedef std::list<std::pair<std::string, Item> > Order; // front - least recently released
+  typedef boost::unordered_multimap<std::string, Order::iterator> Index;
+  typedef boost::unique_lock<boost::mutex> scoped_lock;
+
+  Order order;
+  Index index;
+  size_t items_cap, bytes_cap;
+  size_t bytes;
+  boost::atomic<unsigned long> hits, misses, evictions;
+  boost::mutex mutex;
+
+  DISALLOW_COPY_AND_ASSIGN(DocCache);
+};
+
+#endif // __DOC_CACHE_H
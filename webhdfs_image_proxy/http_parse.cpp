@@ -22,6 +22,8 @@ static int on_headers_complete(http_parser *parser) {
 static int on_message_complete(http_parser *parser) {
   HttpParser *p = (HttpParser*)parser->data;
   p->message_complete = true;
+  if (p->pause_on_message_complete)
+    http_parser_pause(parser, 1);
   return 0;
 }
 
@@ -62,7 +64,7 @@ static int on_body(http_parser *parser, char const *s, size_t len) {
 
 HttpParser::HttpParser(bool is_request)
   : head(headers), tail(headers + arraysize(headers)), header_it(head),
-  status_code(-1), content(content), headers_complete(false), message_complete(false) {
+  status_code(-1), content(content), headers_complete(false), message_complete(false), pause_on_message_complete(false) {
   memset(&settings, 0, sizeof(settings));
   settings.on_message_begin = on_message_begin;
   settings.on_url = on_url;
@@ -84,7 +86,13 @@ void HttpParser::Reset(bool is_request) {
 }
 
 bool HttpParser::Parse(char const *data, size_t len) {
-  if (http_parser_execute(&parser, &settings, data, len) != len) {
+  size_t parsed;
+  return Parse(data, len, &parsed) && parsed == len;
+}
+
+bool HttpParser::Parse(char const *data, size_t len, size_t *parsed) {
+  *parsed = http_parser_execute(&parser, &settings, data, len);
+  if (*parsed != len && HTTP_PARSER_ERRNO(&parser) != HPE_PAUSED) {
     cpcl::Trace(CPCL_TRACE_LEVEL_ERROR, "http_parser error: %s (%s)",
       http_errno_description(HTTP_PARSER_ERRNO(&parser)), http_errno_name(HTTP_PARSER_ERRNO(&parser)));
     return false;
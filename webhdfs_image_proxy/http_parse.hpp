@@ -44,6 +44,7 @@ struct HttpParser {
   int status_code;
   boost::shared_ptr<cpcl::IOStream> content;
   bool headers_complete, message_complete;
+  bool pause_on_message_complete; // stop after message, so bytes of next pipelined message are left unparsed
   
   char const* HttpMethodStr() {
     return http_method_str(static_cast<http_method>(parser.method));
@@ -51,6 +52,10 @@ struct HttpParser {
   http_method HttpMethod() {
     return static_cast<http_method>(parser.method);
   }
+  // valid after message_complete: peer allows next message on the same connection
+  bool ShouldKeepAlive() {
+    return http_should_keep_alive(&parser) != 0;
+  }
   
   explicit HttpParser(bool is_request);
   
@@ -76,6 +81,8 @@ struct HttpParser {
   }
   void Reset(bool is_request);
   bool Parse(char const *data, size_t len);
+  /* parsed receives number of bytes consumed, less than len if parser paused on message complete */
+  bool Parse(char const *data, size_t len, size_t *parsed);
 private:
   http_parser_settings settings;
   http_parser parser;
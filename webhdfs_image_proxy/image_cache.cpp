@@ -1,53 +1,153 @@
 ﻿#include <cpcl/basic.h>
 
+#include <algorithm> // std::max
+
+#include <boost/functional/hash.hpp>
 #include <boost/thread/locks.hpp>
 
 #include <cpcl/trace.h>
-#include <cpcl/dynamic_memory_stream.h>
 
 #include "image_cache.h"
 
-ImageCache::ImageCache(size_t items_cap) : items_cap(items_cap)
-{}
+ImageCache::ImageCache(size_t items_cap, size_t bytes_cap, size_t shards_count)
+  : items_cap(items_cap), bytes_cap(bytes_cap), bytes(0) {
+  if (shards_count < 1)
+    shards_count = 1;
+  shards.reserve(shards_count);
+  for (size_t i = 0; i < shards_count; ++i)
+    shards.push_back(boost::shared_ptr<Shard>(new Shard()));
+  shard_items_cap = (std::max)(items_cap / shards_count, (size_t)1);
+  shard_bytes_cap = bytes_cap / shards_count;
+}
 ImageCache::~ImageCache()
 {}
 
+ImageCache::Shard& ImageCache::ShardOf(std::string const &k) {
+  return *shards[boost::hash<std::string>()(k) % shards.size()];
+}
+
 ImageCache::ItemHit ImageCache::Get(std::string const &k) {
   Value item;
   bool hit(false);
   {
-    scoped_lock lock(mutex, boost::try_to_lock);
-    if (!lock && !lock.timed_lock(boost::posix_time::seconds(1))) {
-      cpcl::Warning(cpcl::StringPieceFromLiteral("ImageCache::Get(): can't obtain exclusive ownership for the current thread"));
-    } else {
-      MapIterator i = map.find(k);
-      if (i != map.end()) {
-        item = (*i).second;
-        hit = true;
-      }
-    }
+    Shard &shard = ShardOf(k);
+    shared_lock lock(shard.mutex);
+    MapIterator i = shard.map.find(k);
+    if (i != shard.map.end()) {
+      Item &v = (*i).second;
+      v.referenced.store(true, boost::memory_order_relaxed);
+      item = v.value;
+      hit = true;
+      shard.hits.fetch_add(1, boost::memory_order_relaxed);
+    } else
+      shard.misses.fetch_add(1, boost::memory_order_relaxed);
   }
-  if (!item)
-    item.reset(new cpcl::DynamicMemoryStream());
   return std::make_pair(item, hit);
 }
 
-void ImageCache::Put(std::string const &k, boost::shared_ptr<cpcl::IOStream> v) {
-  scoped_lock lock(mutex, boost::try_to_lock);
-  if (!lock && !lock.timed_lock(boost::posix_time::seconds(1))) {
-    cpcl::Warning(cpcl::StringPieceFromLiteral("ImageCache::Put(): can't obtain exclusive ownership for the current thread"));
+void ImageCache::Put(std::string const &k, cpcl::SharedBuffer const &v) {
+  if (!v)
+    return;
+  size_t const size = v.Size();
+  if (size > bytes_cap) {
+    cpcl::Trace(CPCL_TRACE_LEVEL_DEBUG,
+      "ImageCache::Put(): \"%s\" size %u exceeds capacity %u bytes, not cached",
+      k.c_str(), (unsigned int)size, (unsigned int)bytes_cap);
     return;
   }
-  
-  std::pair<MapIterator, bool> it = map.insert(Map::value_type(k, v));
-  if (it.second)
-    Push(it.first);
-  else
-    it.first->second = v;
-}
-
-void ImageCache::Push(MapIterator v) {
-  queue.push(v);
-  if (queue.size() > items_cap)
-    queue.pop();
+
+  size_t const index = boost::hash<std::string>()(k) % shards.size();
+  {
+    Shard &shard = *shards[index];
+    scoped_lock lock(shard.mutex);
+    std::pair<MapIterator, bool> it = shard.map.insert(Map::value_type(k, Item()));
+    Item &item = it.first->second;
+    if (it.second) {
+      item.key = &it.first->first;
+      shard.list.push_front(item);
+    } else {
+      shard.bytes -= item.size;
+      bytes -= item.size;
+      shard.list.splice(shard.list.begin(), shard.list, shard.list.iterator_to(item));
+    }
+    item.value = v;
+    item.size = size;
+    shard.bytes += size;
+    bytes += size;
+
+    Evict(shard, shard_bytes_cap, &item);
+  }
+
+  // own shard within its share or holds only new item, budget borrowed from other shards is reclaimed
+  // one shard locked at a time, so concurrent Put of other shards doesn't deadlock
+  for (size_t pass = 0; pass < 2 && bytes > bytes_cap; ++pass) {
+    for (size_t i = 1; i < shards.size() && bytes > bytes_cap; ++i) {
+      Shard &shard = *shards[(index + i) % shards.size()];
+      scoped_lock lock(shard.mutex);
+      Evict(shard, pass ? 0 : shard_bytes_cap, 0);
+    }
+  }
+}
+
+void ImageCache::Evict(Shard &shard, size_t bytes_limit, Item const *spare) {
+  // every item got at most one second chance per pass, so loop ends after list.size() moves at worst
+  size_t second_chances(shard.list.size());
+  while (!shard.list.empty()
+    && (shard.map.size() > shard_items_cap || (shard.bytes > bytes_limit && bytes > bytes_cap))) {
+    Item &item = shard.list.back();
+    if (&item == spare) {
+      // just inserted, not referenced yet, but referenced items moved in front of it must not push it out
+      if (shard.list.size() == 1)
+        break;
+      shard.list.splice(shard.list.begin(), shard.list, shard.list.iterator_to(item));
+      continue;
+    }
+    if (second_chances > 0 && item.referenced.exchange(false, boost::memory_order_relaxed)) {
+      --second_chances;
+      shard.list.splice(shard.list.begin(), shard.list, shard.list.iterator_to(item));
+      continue;
+    }
+    bytes -= item.size;
+    shard.Erase(item);
+    shard.evictions.fetch_add(1, boost::memory_order_relaxed);
+  }
+}
+
+void ImageCache::Shard::Erase(Item &item) {
+  list.erase(list.iterator_to(item));
+  bytes -= item.size;
+  map.erase(map.find(*item.key)); // item && key destroyed here
+}
+
+void ImageCache::HotKeys(size_t max, std::vector<std::string> *keys) {
+  size_t const shard_max = (max + shards.size() - 1) / shards.size();
+  for (Shards::iterator it = shards.begin(), tail = shards.end(); it != tail && max > 0; ++it) {
+    Shard &shard = **it;
+    shared_lock lock(shard.mutex);
+    size_t n(0);
+    for (List::iterator i = shard.list.begin(); i != shard.list.end() && n < shard_max && max > 0; ++i, ++n, --max)
+      keys->push_back(*i->key);
+  }
+}
+
+ImageCache::Stats ImageCache::GetStats() {
+  Stats r = { 0, 0, 0, 0, 0 };
+  for (Shards::iterator it = shards.begin(), tail = shards.end(); it != tail; ++it) {
+    Shard &shard = **it;
+    shared_lock lock(shard.mutex);
+    r.items += shard.map.size();
+    r.bytes += shard.bytes;
+    r.hits += shard.hits.load(boost::memory_order_relaxed);
+    r.misses += shard.misses.load(boost::memory_order_relaxed);
+    r.evictions += shard.evictions.load(boost::memory_order_relaxed);
+  }
+  return r;
+}
+
+void ImageCache::State() {
+  Stats r = GetStats();
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO,
+    "ImageCache::State(): %u shards, items %u/%u, bytes %u/%u, hits %lu, misses %lu, evictions %lu",
+    (unsigned int)shards.size(), (unsigned int)r.items, (unsigned int)items_cap, (unsigned int)r.bytes, (unsigned int)bytes_cap,
+    r.hits, r.misses, r.evictions);
 }
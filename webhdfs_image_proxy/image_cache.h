@@ -4,37 +4,98 @@
 #ifndef __IMAGE_CACHE_H
 #define __IMAGE_CACHE_H
 
-#include <map>
-#include <queue>
 #include <string>
+#include <vector>
 
-#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/intrusive/list.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
-#include <cpcl/io_stream.h>
+#include <cpcl/shared_buffer.h>
 
+/*
+ * LRU cache of images(downloaded originals or encoded responses), images stored as immutable cpcl::SharedBuffer,
+ * so every consumer reads hit through own cpcl::SharedBufferStream cursor
+ * cache split into shards selected by hash of the key
+ * each shard has own reader-writer lock, so hits from different threads don't serialize:
+ * Get takes shared lock and only marks item as referenced, recency list reordered at eviction(second chance, CLOCK)
+ * Put takes exclusive lock of one shard, evicts not referenced items from the tail of the shard list
+ * items live in the hash map, recency list threaded through map nodes(unordered_map never moves its elements),
+ * so Get, Put and eviction are O(1) amortized
+ * bounded both by number of items and by sum of SharedBuffer::Size() of cached images, items cap split evenly between shards
+ * bytes cap is shared: shard may borrow budget of others, so any image up to bytes_cap is cached,
+ * once total exceeds bytes_cap Put evicts from own shard down to its share, then from shards over their share, then from any shard
+ */
 class ImageCache {
-  typedef boost::shared_ptr<cpcl::IOStream> Value;
-  typedef std::map<std::string, Value> Map;
+  typedef cpcl::SharedBuffer Value;
+  typedef boost::intrusive::list_member_hook<> Hook;
+  struct Item {
+    Value value;
+    size_t size;
+    std::string const *key; // points to the key of map node that owns the item
+    boost::atomic<bool> referenced; // set by Get under shared lock
+    Hook hook;
+
+    Item() : size(0), key(0), referenced(false)
+    {}
+    Item(Item const &r) : value(r.value), size(r.size), key(0), referenced(false)
+    {}
+  private:
+    void operator=(Item const&);
+  };
+  typedef boost::unordered_map<std::string, Item> Map;
   typedef Map::iterator MapIterator;
-  typedef std::queue<MapIterator> Queue;
-  typedef boost::unique_lock<boost::timed_mutex> scoped_lock;
+  typedef boost::intrusive::list<Item, boost::intrusive::member_hook<Item, Hook, &Item::hook> > List; // front - most recently inserted or referenced
+  typedef boost::shared_lock<boost::shared_mutex> shared_lock;
+  typedef boost::unique_lock<boost::shared_mutex> scoped_lock;
+
+  struct Shard {
+    Map map;
+    List list;
+    size_t bytes;
+    boost::atomic<unsigned long> hits, misses, evictions;
+    boost::shared_mutex mutex;
+
+    Shard() : bytes(0), hits(0), misses(0), evictions(0)
+    {}
+    ~Shard() {
+      list.clear(); // unlink hooks before map destroys items
+    }
 
-  Map map;
-  Queue queue;
-  size_t items_cap;
-  boost::timed_mutex mutex;
+    void Erase(Item &item);
+  private:
+    DISALLOW_COPY_AND_ASSIGN(Shard);
+  };
+  typedef std::vector<boost::shared_ptr<Shard> > Shards;
 
-  void Push(MapIterator v);
+  Shards shards;
+  size_t items_cap, bytes_cap;
+  size_t shard_items_cap, shard_bytes_cap;
+  boost::atomic<size_t> bytes; // sum of shards bytes
+
+  Shard& ShardOf(std::string const &k);
+  /* items over shard_items_cap, and while total bytes over bytes_cap, shard bytes over bytes_limit; spare - item just inserted, never evicted */
+  void Evict(Shard &shard, size_t bytes_limit, Item const *spare);
   DISALLOW_COPY_AND_ASSIGN(ImageCache);
 public:
-  typedef std::pair<boost::shared_ptr<cpcl::IOStream>, bool> ItemHit;
+  typedef std::pair<cpcl::SharedBuffer, bool> ItemHit;
+  struct Stats {
+    size_t items, bytes;
+    unsigned long hits, misses, evictions;
+  };
 
-  explicit ImageCache(size_t items_cap);
+  ImageCache(size_t items_cap, size_t bytes_cap, size_t shards_count = 0x10);
   ~ImageCache();
 
   ItemHit Get(std::string const &k);
-  void Put(std::string const &k, boost::shared_ptr<cpcl::IOStream> v);
+  void Put(std::string const &k, cpcl::SharedBuffer const &v);
+
+  /* up to max keys appended to keys, most recently inserted or referenced first in every shard */
+  void HotKeys(size_t max, std::vector<std::string> *keys);
 
+  Stats GetStats();
   void State();
 };
 
@@ -0,0 +1,214 @@
+﻿#include <cpcl/basic.h>
+
+#include <string.h> // memcmp, strcmp
+
+#include <cpcl/string_util.hpp>
+
+#include "image_header.h"
+
+static inline unsigned int BE16(unsigned char const *p) { return (p[0] << 8) | p[1]; }
+static inline unsigned int LE16(unsigned char const *p) { return p[0] | (p[1] << 8); }
+static inline unsigned int BE32(unsigned char const *p) { return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static inline unsigned int LE32(unsigned char const *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24); }
+
+// markers without length: TEM, RST0-7, SOI
+static inline bool StandaloneMarker(unsigned char marker) {
+  return 0x01 == marker || (marker >= 0xD0 && marker <= 0xD8);
+}
+// SOF0-SOF15, except DHT, JPG and DAC
+static inline bool FrameMarker(unsigned char marker) {
+  return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+}
+
+static bool ParseJpeg(unsigned char const *data, size_t size, ImageHeader *header, size_t *need) {
+  size_t i = 2;
+  for (;;) {
+    if (i + 4 > size) {
+      *need = i + 4;
+      return false;
+    }
+    if (data[i] != 0xFF)
+      return false;
+    unsigned char const marker = data[i + 1];
+    if (0xFF == marker) { // fill byte
+      ++i;
+      continue;
+    }
+    if (StandaloneMarker(marker)) {
+      i += 2;
+      continue;
+    }
+    if (0xDA == marker || 0xD9 == marker)
+      return false; // scan or end of image before frame header
+    if (FrameMarker(marker)) {
+      if (i + 10 > size) {
+        *need = i + 10;
+        return false;
+      }
+      header->height = BE16(data + i + 5);
+      header->width = BE16(data + i + 7);
+      unsigned char const components = data[i + 9];
+      header->pf = (1 == components) ? "gray8" : (3 == components) ? "bgr24" : "invalid"; // 4 - cmyk or ycck
+      if (data[i + 4] != 8)
+        header->pf = "invalid"; // 12 bit samples
+      return header->width > 0 && header->height > 0; // zero height - defined by DNL after first scan
+    }
+    unsigned int const len = BE16(data + i + 2);
+    if (len < 2)
+      return false;
+    i += 2 + len;
+  }
+}
+
+static bool ParsePng(unsigned char const *data, size_t size, ImageHeader *header, size_t *need) {
+  if (size < 26) {
+    *need = 26;
+    return false;
+  }
+  if (::memcmp(data + 12, "IHDR", 4) != 0)
+    return false;
+  header->width = BE32(data + 16);
+  header->height = BE32(data + 20);
+  unsigned char const bit_depth = data[24], color_type = data[25];
+  if (0 == color_type && bit_depth <= 8)
+    header->pf = "gray8";
+  else if (2 == color_type && 8 == bit_depth)
+    header->pf = "bgr24";
+  else if (6 == color_type && 8 == bit_depth)
+    header->pf = "bgra32";
+  else
+    header->pf = "invalid"; // palette, gray with alpha, 16 bit
+  return header->width > 0 && header->height > 0;
+}
+
+static bool ParseGif(unsigned char const *data, size_t size, ImageHeader *header, size_t *need) {
+  if (size < 10) {
+    *need = 10;
+    return false;
+  }
+  header->width = LE16(data + 6);
+  header->height = LE16(data + 8);
+  header->pf = "invalid"; // palette, transparency known only from graphic control extension
+  return header->width > 0 && header->height > 0;
+}
+
+static bool ParseBmp(unsigned char const *data, size_t size, ImageHeader *header, size_t *need) {
+  if (size < 30) {
+    *need = 30;
+    return false;
+  }
+  unsigned int bit_count;
+  if (12 == LE32(data + 14)) { // BITMAPCOREHEADER
+    header->width = LE16(data + 18);
+    header->height = LE16(data + 20);
+    bit_count = LE16(data + 24);
+  } else {
+    int const width = (int)LE32(data + 18), height = (int)LE32(data + 22); // height < 0 - top-down bitmap
+    header->width = (width < 0) ? 0 : (unsigned int)width;
+    header->height = (height < 0) ? (unsigned int)-height : (unsigned int)height;
+    bit_count = LE16(data + 28);
+  }
+  header->pf = (24 == bit_count) ? "bgr24" : "invalid"; // palette, 16 bit, 32 bit with or without alpha
+  return header->width > 0 && header->height > 0;
+}
+
+static bool ParseTiff(unsigned char const *data, size_t size, ImageHeader *header, size_t *need) {
+  bool const le = ('I' == data[0]);
+  unsigned int (*u16)(unsigned char const*) = le ? LE16 : BE16;
+  unsigned int (*u32)(unsigned char const*) = le ? LE32 : BE32;
+  if (u16(data + 2) != 42)
+    return false; // BigTIFF or garbage
+  size_t const ifd = u32(data + 4);
+  if (ifd < 8)
+    return false;
+  if (ifd + 2 > size) {
+    *need = ifd + 2;
+    return false;
+  }
+  size_t const entries = u16(data + ifd);
+  if (ifd + 2 + entries * 12 > size) {
+    *need = ifd + 2 + entries * 12;
+    return false;
+  }
+  unsigned int samples(1), photometric(1), bits(1);
+  for (size_t k = 0; k < entries; ++k) {
+    unsigned char const *entry = data + ifd + 2 + k * 12;
+    unsigned int const tag = u16(entry), type = u16(entry + 2);
+    unsigned int value;
+    if (258 == tag && 3 == type && u32(entry + 4) > 2) { // BitsPerSample of every sample, stored apart
+      size_t const offset = u32(entry + 8);
+      bits = (offset + 2 <= size) ? u16(data + offset) : 0; // not in prefix - pixel format unknown
+      continue;
+    }
+    if (3 == type) // SHORT
+      value = u16(entry + 8);
+    else if (4 == type) // LONG
+      value = u32(entry + 8);
+    else
+      continue;
+    switch (tag) {
+    case 256: header->width = value; break;
+    case 257: header->height = value; break;
+    case 258: bits = value; break;
+    case 262: photometric = value; break;
+    case 277: samples = value; break;
+    }
+  }
+  if (1 == samples && photometric <= 1 && bits <= 8) // white or black is zero
+    header->pf = "gray8";
+  else if (3 == samples && 2 == photometric && 8 == bits)
+    header->pf = "bgr24";
+  else if (4 == samples && 2 == photometric && 8 == bits) // rgb with extra sample
+    header->pf = "bgra32";
+  else
+    header->pf = "invalid"; // palette, cmyk, ycbcr, 16 bit
+  return header->width > 0 && header->height > 0;
+}
+
+bool ParseImageHeader(unsigned char const *data, size_t size, ImageHeader *header, size_t *need) {
+  *need = 0;
+  if (size < 8) {
+    *need = 8;
+    return false;
+  }
+  if (0xFF == data[0] && 0xD8 == data[1])
+    return ParseJpeg(data, size, header, need);
+  if (::memcmp(data, "\x89PNG\r\n\x1A\n", 8) == 0)
+    return ParsePng(data, size, header, need);
+  if (::memcmp(data, "GIF87a", 6) == 0 || ::memcmp(data, "GIF89a", 6) == 0)
+    return ParseGif(data, size, header, need);
+  if ('B' == data[0] && 'M' == data[1])
+    return ParseBmp(data, size, header, need);
+  if (::memcmp(data, "II*\0", 4) == 0 || ::memcmp(data, "MM\0*", 4) == 0)
+    return ParseTiff(data, size, header, need);
+  return false;
+}
+
+static char const* pixel_formats[] = { "invalid", "gray8", "rgb24", "bgr24", "rgba32", "argb32", "abgr32", "bgra32" };
+
+char const* PixelFormatName(unsigned int i) {
+  return pixel_formats[(i < arraysize(pixel_formats)) ? i : 0];
+}
+
+unsigned int PixelFormatIndex(char const *name) {
+  for (unsigned int i = 0; i < arraysize(pixel_formats); ++i) {
+    if (::strcmp(pixel_formats[i], name) == 0)
+      return i;
+  }
+  return 0;
+}
+
+void WriteImageInfo(ImageHeader const &header, cpcl::IOStream *out) {
+  char json_response[0x100];
+  size_t n;
+  if (!PixelFormatIndex(header.pf)) {
+    n = cpcl::StringFormat(json_response,
+      "{'width' : '%u', 'height' : '%u'}",
+      header.width, header.height);
+  } else {
+    n = cpcl::StringFormat(json_response,
+      "{'width' : '%u', 'height' : '%u', 'pf' : '%s'}",
+      header.width, header.height, header.pf);
+  }
+  out->Write(json_response, (cpcl::uint32)n);
+}
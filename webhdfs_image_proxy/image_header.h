@@ -0,0 +1,40 @@
+﻿// image_header.h
+#pragma once
+
+#ifndef __IMAGE_HEADER_H
+#define __IMAGE_HEADER_H
+
+#include <stddef.h>
+
+#include <cpcl/io_stream.h>
+
+// size and pixel format of the first image, as reported in page info json
+struct ImageHeader {
+  unsigned int width, height;
+  char const *pf; // "gray8", "bgr24", "bgra32" e.t.c., "invalid" - not known, omitted from page info json
+
+  ImageHeader() : width(0), height(0), pf("invalid")
+  {}
+  ImageHeader(unsigned int width, unsigned int height, char const *pf) : width(width), height(height), pf(pf)
+  {}
+};
+
+/*
+ * parse leading bytes of the original: JPEG SOF segment, PNG IHDR, GIF logical screen, BMP info header, TIFF first IFD
+ * so page info answered without downloading and decoding the whole file
+ * pixel format reported only for layouts every decoder gives the same way(8 bit gray, rgb, rgba, gray and ycbcr jpeg),
+ * palette, cmyk, 16 bit and other layouts get "invalid", decoder fills pf once the file is rendered
+ * returns true if header parsed, otherwise *need - size of prefix required to go on(greater than size),
+ * or 0 if format unknown or header corrupted
+ */
+bool ParseImageHeader(unsigned char const *data, size_t size, ImageHeader *header, size_t *need);
+
+/* pixel format names of page info json, index fits in byte: 0 - "invalid", 1 - "gray8", 2 - "rgb24" ... 7 - "bgra32" */
+char const* PixelFormatName(unsigned int i);
+/* 0 if name unknown */
+unsigned int PixelFormatIndex(char const *name);
+
+/* page info json: {'width' : '%u', 'height' : '%u', 'pf' : '%s'}, pf omitted if "invalid" */
+void WriteImageInfo(ImageHeader const &header, cpcl::IOStream *out);
+
+#endif // __IMAGE_HEADER_H
@@ -7,10 +7,10 @@
 
 #include "jpeg_rendering_device.h"
 
-JpegRenderingDevice::JpegRenderingDevice(boost::shared_ptr<cpcl::IOStream> out)
+JpegRenderingDevice::JpegRenderingDevice(boost::shared_ptr<cpcl::IOStream> out, CancelToken const &cancel_token)
   : RenderingDevice(PLCL_PIXEL_FORMAT_GRAY_8 | PLCL_PIXEL_FORMAT_BGR_24, PLCL_PIXEL_FORMAT_BGR_24),
   width(0), height(0), input_components(3), initialized(false), write_scanline(false), flip(false),
-  jpeg_output_manager(out)
+  jpeg_output_manager(out), cancel_token(cancel_token)
 {}
 JpegRenderingDevice::~JpegRenderingDevice()
 {}
@@ -91,6 +91,8 @@ bool JpegRenderingDevice::SetViewport(unsigned int x1, unsigned int y1, unsigned
 }
 
 void JpegRenderingDevice::SweepScanline(unsigned int y, unsigned char **scanline) {
+  if (cancel_token.Cancelled())
+    throw cancelled_exception();
   bool check_flip(!initialized);
   if (!Init()) {
     cpcl::Error(cpcl::StringPieceFromLiteral("JpegRenderingDevice::SweepScanline(): initialization failed"));
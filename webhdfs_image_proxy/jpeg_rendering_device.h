@@ -2,6 +2,7 @@
 #pragma once
 
 #include "jpeg_compressor_stuff.h"
+#include "cancel_token.h"
 
 #include <boost/shared_ptr.hpp>
 
@@ -16,12 +17,14 @@ class JpegRenderingDevice : public plcl::RenderingDevice {
   cpcl::ScopedBuf<unsigned char, 0> scanline_buf;
   JpegStuff jpeg_stuff;
   JpegOutputManager jpeg_output_manager;
+  CancelToken cancel_token;
 
   bool Init();
 
   DISALLOW_COPY_AND_ASSIGN(JpegRenderingDevice);
 public:
-  explicit JpegRenderingDevice(boost::shared_ptr<cpcl::IOStream> out);
+  /* SweepScanline throws cancelled_exception once cancel_token cancelled */
+  JpegRenderingDevice(boost::shared_ptr<cpcl::IOStream> out, CancelToken const &cancel_token = CancelToken());
   virtual ~JpegRenderingDevice();
 
   virtual void Pixfmt(unsigned int v);
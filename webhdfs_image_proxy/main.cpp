@@ -8,6 +8,8 @@
 #include <cpcl/file_util.h>
 #include <cpcl/trace.h>
 
+#include "options.h"
+
 //struct Query {
 //	/*cpcl::StringPiece request_path;*/
 //	unsigned int width, height;
@@ -23,7 +25,7 @@
 //}
 //}
 
-void RunServer(std::string const &in_host, std::string const &in_port, std::string const &out_host, std::string const &out_port);
+void RunServer(std::string const &in_host, std::string const &in_port, std::string const &out_host, std::string const &out_port, Options const &options);
 
 #ifdef _MSC_VER
 static inline std::string w2c(wchar_t const *s) {
@@ -36,7 +38,8 @@ int main(int argc, char **argv)
 {
   if (argc < 5) {
     // hadoop.namenode.virtu.com 50070
-    std::cout << "<listen-host> <listen-port> <namenode-host> <namenode-port>" << std::endl;
+    std::cout << "<listen-host> <listen-port> <namenode-host> <namenode-port> [option=value ...]" << std::endl;
+    Options::Usage(std::cout);
     return 0;
   }
   {
@@ -46,10 +49,23 @@ int main(int argc, char **argv)
       cpcl::SetTraceFilePath(cpcl::Join(module_path, cpcl::BaseName(argv[0])) + buf);
   }
   cpcl::Debug(cpcl::StringPieceFromLiteral("Log started"));
+  Options options;
+  for (int i = 5; i < argc; ++i) {
+#ifdef _MSC_VER 
+    std::string const arg = w2c(argv[i]);
+#else
+    std::string const arg(argv[i]);
+#endif
+    if (!options.Parse(arg)) {
+      std::cout << "invalid option: " << arg << std::endl;
+      Options::Usage(std::cout);
+      return 1;
+    }
+  }
 #ifdef _MSC_VER 
-  RunServer(w2c(argv[1]), w2c(argv[2]), w2c(argv[3]), w2c(argv[4]));
+  RunServer(w2c(argv[1]), w2c(argv[2]), w2c(argv[3]), w2c(argv[4]), options);
 #else
-  RunServer(argv[1], argv[2], argv[3], argv[4]);
+  RunServer(argv[1], argv[2], argv[3], argv[4], options);
 #endif
   // RunServer("127.0.0.1", "8080", "google.com", "80");
   return 0;
@@ -0,0 +1,102 @@
+﻿#include <cpcl/basic.h>
+
+#include <boost/thread/locks.hpp>
+
+#include <cpcl/trace.h>
+
+#include "metadata_cache.h"
+
+MetadataCache::MetadataCache(size_t items_cap)
+  : sets_mask(0), set_bits(0), hits(0), misses(0), evictions(0), items(0) {
+  size_t const sets = items_cap / WAYS;
+  if (!sets)
+    return;
+  while (((size_t)2 << set_bits) <= sets)
+    ++set_bits;
+  sets_mask = ((size_t)1 << set_bits) - 1;
+  Entry const empty = { 0, 0, 0, 0, 0, 0 };
+  entries.assign((sets_mask + 1) * WAYS, empty);
+}
+
+/* FNV-1a over path '\0' version, then murmur3 finalizer so set index bits are mixed */
+MetadataCache::Key MetadataCache::KeyOf(std::string const &path, std::string const &version) {
+  Key h(14695981039346656037ULL);
+  for (std::string::const_iterator it = path.begin(); it != path.end(); ++it)
+    h = (h ^ (unsigned char)*it) * 1099511628211ULL;
+  h *= 1099511628211ULL;
+  for (std::string::const_iterator it = version.begin(); it != version.end(); ++it)
+    h = (h ^ (unsigned char)*it) * 1099511628211ULL;
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+bool MetadataCache::Match(Entry const &entry, Key key) const {
+  return entry.width > 0
+    && entry.key_low == (cpcl::uint16)(key >> set_bits)
+    && entry.key_high == (cpcl::uint32)(key >> (set_bits + 16));
+}
+
+bool MetadataCache::Get(Key key, ImageHeader *header) {
+  if (!entries.empty()) {
+    size_t const set = SetOf(key);
+    scoped_lock lock(locks[set % LOCKS]);
+    Entry *it = &entries[set * WAYS];
+    for (Entry *tail = it + WAYS; it != tail; ++it) {
+      if (Match(*it, key)) {
+        it->referenced = 1;
+        *header = ImageHeader(it->width, it->height, PixelFormatName(it->pf));
+        ++hits;
+        return true;
+      }
+    }
+  }
+  ++misses;
+  return false;
+}
+
+void MetadataCache::Put(Key key, ImageHeader const &header) {
+  if (entries.empty() || !header.width)
+    return;
+  size_t const set = SetOf(key);
+  scoped_lock lock(locks[set % LOCKS]);
+  Entry *head = &entries[set * WAYS], *victim(0);
+  for (size_t i = 0; i < WAYS; ++i) {
+    if (Match(head[i], key)) {
+      victim = head + i;
+      break;
+    }
+    if (!victim && !head[i].width)
+      victim = head + i;
+  }
+  if (!victim) {
+    // second chance: clear referenced bits until unreferenced entry found, all referenced - first one evicted
+    for (size_t i = 0; i < WAYS && !victim; ++i) {
+      if (!head[i].referenced)
+        victim = head + i;
+      else
+        head[i].referenced = 0;
+    }
+    if (!victim)
+      victim = head;
+    ++evictions;
+  } else if (!victim->width)
+    ++items;
+
+  victim->key_high = (cpcl::uint32)(key >> (set_bits + 16));
+  victim->key_low = (cpcl::uint16)(key >> set_bits);
+  victim->width = header.width;
+  victim->height = header.height;
+  victim->pf = (unsigned char)PixelFormatIndex(header.pf);
+  victim->referenced = 0;
+}
+
+void MetadataCache::State() {
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO,
+    "MetadataCache::State(): items %u/%u, %u bytes, hits %lu, misses %lu, evictions %lu",
+    (unsigned int)items.load(), (unsigned int)entries.size(), (unsigned int)(entries.size() * sizeof(Entry)),
+    hits.load(), misses.load(), evictions.load());
+}
@@ -0,0 +1,63 @@
+﻿// metadata_cache.h
+#pragma once
+
+#ifndef __METADATA_CACHE_H
+#define __METADATA_CACHE_H
+
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cpcl/basic.h>
+
+#include "image_header.h"
+
+/*
+ * page size and pixel format of originals, keyed by 64-bit hash of webhdfs path && file version
+ * answers ?info and plans output size of renders without download or decode
+ * entry is 16 bytes in preallocated 4-way set associative table, no per-entry allocation or key string,
+ * so millions of entries cost tens of megabytes
+ * set replacement is CLOCK: Get marks entry referenced, Put evicts first unreferenced entry of the set
+ * hash collision gives metadata of other file, with 64-bit keys it is not expected in practice
+ */
+class MetadataCache {
+public:
+  typedef cpcl::uint64 Key;
+
+  /* items_cap rounded down to power of two sets, 0 - cache disabled */
+  explicit MetadataCache(size_t items_cap);
+
+  /* version - empty if file status unknown */
+  static Key KeyOf(std::string const &path, std::string const &version);
+
+  bool Get(Key key, ImageHeader *header);
+  void Put(Key key, ImageHeader const &header);
+
+  void State();
+private:
+  enum { WAYS = 4, LOCKS = 64 };
+  struct Entry {
+    cpcl::uint32 key_high; // 0 with zero width - empty slot
+    cpcl::uint32 width, height;
+    cpcl::uint16 key_low; // set index takes low bits of key, 16 bits above them kept here
+    unsigned char pf; // PixelFormatIndex
+    unsigned char referenced;
+  };
+  typedef boost::unique_lock<boost::mutex> scoped_lock;
+
+  std::vector<Entry> entries; // sets * WAYS
+  size_t sets_mask;
+  unsigned int set_bits;
+  boost::atomic<unsigned long> hits, misses, evictions;
+  boost::atomic<size_t> items;
+  boost::mutex locks[LOCKS]; // striped by set index
+
+  size_t SetOf(Key key) const { return (size_t)key & sets_mask; }
+  bool Match(Entry const &entry, Key key) const;
+
+  DISALLOW_COPY_AND_ASSIGN(MetadataCache);
+};
+
+#endif // __METADATA_CACHE_H
@@ -0,0 +1,130 @@
+﻿#include <cpcl/basic.h>
+
+#include <algorithm>
+#include <ostream>
+
+#include <cpcl/string_util.hpp>
+#include <cpcl/string_cast.hpp>
+#include <cpcl/trace.h>
+
+#include "options.h"
+
+using namespace cpcl;
+
+struct UnsignedOption {
+  char const *name;
+  unsigned int Options::*value;
+  char const *description;
+} static const unsigned_options[] = {
+  { "upstream_idle_per_host", &Options::upstream_idle_per_host, "idle keep-alive sockets kept per webhdfs host" },
+  { "upstream_idle_timeout", &Options::upstream_idle_timeout, "seconds before idle webhdfs socket closed" },
+  { "dns_ttl", &Options::dns_ttl, "seconds resolved webhdfs host kept fresh" },
+  { "dns_negative_ttl", &Options::dns_negative_ttl, "seconds failed resolve kept" },
+  { "location_ttl", &Options::location_ttl, "seconds datanode redirect of path kept, 0 disables" },
+  { "location_cache_items", &Options::location_cache_items, "max number of cached datanode redirects" },
+  { "image_cache_items", &Options::image_cache_items, "max number of originals kept in memory" },
+  { "image_cache_bytes", &Options::image_cache_bytes, "max bytes of originals kept in memory, also max size of cached original" },
+  { "render_cache_items", &Options::render_cache_items, "max number of encoded responses kept in memory" },
+  { "render_cache_bytes", &Options::render_cache_bytes, "max bytes of encoded responses kept in memory" },
+  { "status_ttl", &Options::status_ttl, "seconds file status(ETag, Last-Modified) of path kept, 0 disables validators" },
+  { "status_cache_items", &Options::status_cache_items, "max number of cached file statuses" },
+  { "metadata_cache_items", &Options::metadata_cache_items, "max number of cached page sizes and pixel formats, 16 bytes each" },
+  { "doc_cache_items", &Options::doc_cache_items, "max number of loaded documents kept between renders" },
+  { "doc_cache_bytes", &Options::doc_cache_bytes, "max estimated bytes of loaded documents(original + decoded page)" },
+  { "disk_cache_mb", &Options::disk_cache_mb, "max megabytes of originals and renders kept in disk_cache_dir" },
+  { "disk_cache_write_queue", &Options::disk_cache_write_queue, "max entries waiting for disk write, more dropped" },
+  { "warm_keys", &Options::warm_keys, "hottest keys of memory caches saved at shutdown and prefetched from disk cache at startup" },
+  { "prewarm_concurrency", &Options::prewarm_concurrency, "prewarm requests in flight" },
+  { "prewarm_rate", &Options::prewarm_rate, "prewarm requests started per second, 0 - not limited" },
+  { "info_probe_bytes", &Options::info_probe_bytes, "leading bytes of original read for ?info, 0 - download whole file" },
+  { "info_probe_limit", &Options::info_probe_limit, "max bytes read for ?info before whole file downloaded" },
+  { "client_idle_timeout", &Options::client_idle_timeout, "seconds to wait for next request on client connection" },
+  { "client_max_requests", &Options::client_max_requests, "requests served on one client connection, 0 - unlimited" },
+  { "render_threads", &Options::render_threads, "decode and render worker threads, 0 - one per core" },
+  { "render_queue_limit", &Options::render_queue_limit, "queued render tasks before 503, 0 - unbounded" },
+  { "render_wait_target", &Options::render_wait_target, "milliseconds of average render queue wait before 503, 0 - not checked" },
+  { "render_small_pixels", &Options::render_small_pixels, "output pixels of small render, served ahead of larger" },
+  { "render_aging", &Options::render_aging, "milliseconds large render may be overtaken by small ones" },
+  { "render_stream_buffer", &Options::render_stream_buffer, "bytes of jpeg buffered for client while encoding, 0 - send after render" },
+  { "render_stream_cache_limit", &Options::render_stream_cache_limit, "max bytes of streamed render put to render cache" },
+  { "retry_after", &Options::retry_after, "Retry-After seconds of 503 response" },
+  { "request_timeout", &Options::request_timeout, "milliseconds to serve request before 504, 0 - unlimited" }
+};
+
+Options::Options()
+  : upstream_idle_per_host(8), upstream_idle_timeout(30),
+  dns_ttl(60), dns_negative_ttl(5),
+  location_ttl(60), location_cache_items(0x10000),
+  image_cache_items(0x1000), image_cache_bytes(0x10000000), render_cache_items(0x10000), render_cache_bytes(0x8000000),
+  status_ttl(5), status_cache_items(0x10000), metadata_cache_items(0x100000),
+  doc_cache_items(0x40), doc_cache_bytes(0x10000000),
+  disk_cache_mb(0x2800), disk_cache_write_queue(0x100), warm_keys(0x1000),
+  prewarm_concurrency(4), prewarm_rate(20),
+  info_probe_bytes(0x4000), info_probe_limit(0x40000),
+  client_idle_timeout(15), client_max_requests(100),
+  render_threads(0), render_queue_limit(0x400), render_wait_target(2000),
+  render_small_pixels(512 * 512), render_aging(1000),
+  render_stream_buffer(0x10000), render_stream_cache_limit(0x1000000), retry_after(1),
+  request_timeout(30000)
+{}
+
+bool Options::Parse(StringPiece const &s) {
+  char const *eq = std::find(s.begin(), s.end(), '=');
+  if (s.end() == eq) {
+    Trace(CPCL_TRACE_LEVEL_ERROR, "Options::Parse(): \"%s\" is not name=value pair", s.as_string().c_str());
+    return false;
+  }
+  StringPiece const name(s.begin(), eq - s.begin()), value(eq + 1, s.end() - (eq + 1));
+  if (StringEqualsIgnoreCaseASCII(name, StringPieceFromLiteral("cache_control"))) {
+    char const *colon = std::find(value.begin(), value.end(), ':');
+    if (value.end() == colon || value.begin() == colon) {
+      Trace(CPCL_TRACE_LEVEL_ERROR, "Options::Parse(): cache_control \"%s\" is not prefix:value pair", value.as_string().c_str());
+      return false;
+    }
+    cache_control.push_back(std::make_pair(std::string(value.begin(), colon), std::string(colon + 1, value.end())));
+    return true;
+  }
+  if (StringEqualsIgnoreCaseASCII(name, StringPieceFromLiteral("disk_cache_dir"))) {
+    disk_cache_dir = value.as_string();
+    return true;
+  }
+  if (StringEqualsIgnoreCaseASCII(name, StringPieceFromLiteral("prewarm_file"))) {
+    prewarm_file = value.as_string();
+    return true;
+  }
+  for (size_t k = 0; k < arraysize(unsigned_options); ++k) {
+    if (StringEqualsIgnoreCaseASCII(name, StringPiece(unsigned_options[k].name))) {
+      unsigned int v;
+      if (!TryConvert(value, &v)) {
+        Trace(CPCL_TRACE_LEVEL_ERROR, "Options::Parse(): invalid value \"%s\" for %s", value.as_string().c_str(), unsigned_options[k].name);
+        return false;
+      }
+      this->*unsigned_options[k].value = v;
+      return true;
+    }
+  }
+  Trace(CPCL_TRACE_LEVEL_ERROR, "Options::Parse(): unknown option \"%s\"", name.as_string().c_str());
+  return false;
+}
+
+std::string const* Options::CacheControl(StringPiece const &path) const {
+  std::string const *r(0);
+  size_t r_len(0);
+  for (std::vector<std::pair<std::string, std::string> >::const_iterator it = cache_control.begin(), tail = cache_control.end(); it != tail; ++it) {
+    if (path.starts_with(it->first) && (!r || it->first.size() > r_len)) {
+      r = &it->second;
+      r_len = it->first.size();
+    }
+  }
+  return r;
+}
+
+void Options::Usage(std::ostream &out) {
+  Options defaults;
+  out << "options:" << std::endl;
+  for (size_t k = 0; k < arraysize(unsigned_options); ++k)
+    out << "  " << unsigned_options[k].name << "=" << defaults.*unsigned_options[k].value << " - " << unsigned_options[k].description << std::endl;
+  out << "  cache_control=<path prefix>:<value> - Cache-Control of responses under path prefix, may be repeated" << std::endl;
+  out << "  disk_cache_dir=<directory> - originals and renders kept on local disk, disabled if not set" << std::endl;
+  out << "  prewarm_file=<csv> - rows \"path,w,h\" requested at startup, progress at /_admin/prewarm, new file started by /_admin/prewarm?file=<csv>" << std::endl;
+}
@@ -0,0 +1,97 @@
+﻿// options.h
+#pragma once
+
+#ifndef __OPTIONS_H
+#define __OPTIONS_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <iosfwd>
+
+#include <cpcl/string_piece.hpp>
+
+// server tuning, given on command line as name=value pairs after positional arguments
+struct Options {
+  // idle keep-alive sockets kept per webhdfs host(namenode or datanode)
+  unsigned int upstream_idle_per_host;
+  // idle keep-alive socket closed after this many seconds
+  unsigned int upstream_idle_timeout;
+  // resolved webhdfs host endpoints fresh for this many seconds, then refreshed in background
+  unsigned int dns_ttl;
+  // failed resolve cached for this many seconds
+  unsigned int dns_negative_ttl;
+  // namenode redirects to datanode kept for this many seconds, 0 disables
+  unsigned int location_ttl;
+  unsigned int location_cache_items;
+  // downloaded originals kept in memory, bytes cap shared by shards, so original up to image_cache_bytes cached
+  unsigned int image_cache_items;
+  unsigned int image_cache_bytes;
+  // encoded responses kept in memory
+  unsigned int render_cache_items;
+  unsigned int render_cache_bytes;
+  // GETFILESTATUS of path kept for this many seconds, 0 disables validators(ETag, Last-Modified)
+  unsigned int status_ttl;
+  unsigned int status_cache_items;
+  // page size && pixel format of this many originals kept(16 bytes each), 0 disables
+  unsigned int metadata_cache_items;
+  // loaded docs kept between renders of the same original, 0 disables
+  unsigned int doc_cache_items;
+  // estimated bytes of kept docs(original + decoded page)
+  unsigned int doc_cache_bytes;
+  // megabytes of originals and renders kept in disk_cache_dir
+  unsigned int disk_cache_mb;
+  // entries waiting for disk write, more dropped
+  unsigned int disk_cache_write_queue;
+  // keys of memory caches saved at shutdown and loaded from disk cache at startup, 0 - no warm restart
+  unsigned int warm_keys;
+  // loopback requests of prewarm in flight
+  unsigned int prewarm_concurrency;
+  // prewarm requests started per second, 0 - not limited
+  unsigned int prewarm_rate;
+  // ?info reads only this many leading bytes of original to parse image header, 0 - always download whole file
+  unsigned int info_probe_bytes;
+  // probe grows up to this many bytes if header needs more, then whole file downloaded
+  unsigned int info_probe_limit;
+  // keep-alive client connection closed if next request doesn't arrive in this many seconds
+  unsigned int client_idle_timeout;
+  // requests served on one client connection, 0 - unlimited
+  unsigned int client_max_requests;
+  // TaskPool workers decoding and rendering images, 0 - one per core
+  unsigned int render_threads;
+  // tasks waiting for render worker, more answered 503, 0 - unbounded
+  unsigned int render_queue_limit;
+  // average queue wait in milliseconds above which new tasks answered 503, 0 - not checked
+  unsigned int render_wait_target;
+  // output of at most this many pixels rendered ahead of larger ones
+  unsigned int render_small_pixels;
+  // milliseconds large render may be overtaken by small ones and page info
+  unsigned int render_aging;
+  // bytes of encoded jpeg buffered between render worker and client, 0 - whole image rendered before sending
+  unsigned int render_stream_buffer;
+  // streamed render up to this many bytes also put to render cache
+  unsigned int render_stream_cache_limit;
+  // Retry-After seconds of 503 response
+  unsigned int retry_after;
+  // milliseconds to serve request(fetch, decode and render) before 504, 0 - unlimited
+  // query "timeout=" may only shorten it
+  unsigned int request_timeout;
+  // Cache-Control value of responses under webhdfs path prefix, longest prefix wins,
+  // given as cache_control=prefix:value, may be repeated
+  std::vector<std::pair<std::string, std::string> > cache_control;
+  // directory of disk cache, empty - disk cache disabled
+  std::string disk_cache_dir;
+  // CSV of "path,w,h" prewarmed at startup, empty - no prewarm
+  std::string prewarm_file;
+
+  Options();
+
+  /* Cache-Control value for webhdfs path, NULL if no prefix matches */
+  std::string const* CacheControl(cpcl::StringPiece const &path) const;
+
+  /* parse "name=value", returns false for unknown name or invalid value */
+  bool Parse(cpcl::StringPiece const &s);
+  static void Usage(std::ostream &out);
+};
+
+#endif // __OPTIONS_H
@@ -0,0 +1,261 @@
+﻿#include <cpcl/basic.h>
+
+#include <algorithm> // std::max
+
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cpcl/string_util.hpp>
+#include <cpcl/string_cast.hpp>
+#include <cpcl/trace.h>
+
+#include "prewarmer.h"
+#include "proxy_context.h"
+
+using cpcl::StringPiece;
+using cpcl::StringPieceFromLiteral;
+using cpcl::StringFormat;
+
+namespace pt = boost::posix_time;
+
+typedef boost::unique_lock<boost::mutex> scoped_lock;
+
+Prewarmer::Prewarmer(boost::asio::io_service &io_service, boost::asio::ip::tcp::endpoint endpoint, ProxyContext *context,
+  unsigned int concurrency, unsigned int rate)
+  : io_service(io_service), strand(io_service), endpoint(endpoint), context(context),
+  concurrency((std::max)(concurrency, 1U)), interval(rate > 0 ? pt::microseconds(1000000 / rate) : pt::microseconds(0)),
+  timer(io_service), timer_armed(false), timer_generation(0), reader_eof(false), in_flight(0),
+  running(false), stop_requested(false), rows(0), done(0), failed(0), skipped(0) {
+  if (this->endpoint.address().is_unspecified()) {
+    if (this->endpoint.address().is_v6())
+      this->endpoint.address(boost::asio::ip::address_v6::loopback());
+    else
+      this->endpoint.address(boost::asio::ip::address_v4::loopback());
+  }
+}
+Prewarmer::~Prewarmer()
+{}
+
+int Prewarmer::Start(std::string const &csv_path) {
+  if (running.exchange(true))
+    return 503;
+  cpcl::FileStream *file_;
+  if (!cpcl::FileStream::Read(csv_path.c_str(), &file_)) {
+    running = false;
+    return 404;
+  }
+  {
+    scoped_lock lock(mutex);
+    this->csv_path = csv_path;
+    started = pt::microsec_clock::universal_time();
+    finished = pt::ptime();
+  }
+  rows = done = failed = skipped = 0;
+  stop_requested = false;
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO, "Prewarmer::Start(): %s, %u sessions, %lld us between sessions",
+    csv_path.c_str(), (unsigned int)concurrency, (long long)interval.total_microseconds());
+  strand.post(boost::bind(&Prewarmer::Begin, shared_from_this(), boost::shared_ptr<cpcl::FileStream>(file_)));
+  return 202;
+}
+
+/* strand state of the new job, timer wait of previous job may still complete */
+void Prewarmer::Begin(boost::shared_ptr<cpcl::FileStream> file) {
+  this->file = file;
+  reader.reset(new Reader(file.get(), true));
+  reader_eof = false;
+  next_start = pt::ptime();
+  timer_armed = false;
+  ++timer_generation;
+  Fill();
+}
+
+void Prewarmer::Stop() {
+  stop_requested = true;
+  strand.post(boost::bind(&Prewarmer::Fill, shared_from_this()));
+}
+
+/* start sessions while slots free, rows left and rate allows, otherwise wait for completion or timer */
+void Prewarmer::Fill() {
+  if (!running || !reader.get())
+    return; // idle, or Stop posted before Begin of the job ran
+  while (in_flight < concurrency && !reader_eof && !stop_requested) {
+    if (interval.total_microseconds() > 0) {
+      pt::ptime const now = pt::microsec_clock::universal_time();
+      if (!next_start.is_not_a_date_time() && now < next_start) {
+        if (!timer_armed) {
+          timer_armed = true;
+          timer.expires_at(next_start);
+          timer.async_wait(strand.wrap(boost::bind(&Prewarmer::handle_timer, shared_from_this(),
+            boost::asio::placeholders::error, ++timer_generation)));
+        }
+        return;
+      }
+      next_start = ((next_start.is_not_a_date_time() || next_start < now) ? now : next_start) + interval;
+    }
+    std::string uri;
+    if (!NextRow(&uri)) {
+      reader_eof = true;
+      break;
+    }
+    StartSession(uri);
+  }
+  if (!in_flight && (reader_eof || stop_requested))
+    Finish();
+}
+
+void Prewarmer::handle_timer(boost::system::error_code const &ec, unsigned int generation) {
+  if (generation != timer_generation)
+    return; // wait of previous job, cancelled by Finish
+  timer_armed = false;
+  if (boost::asio::error::operation_aborted != ec)
+    Fill();
+}
+
+/* next valid row as request uri: path?w=..&h=.., rows with path not suitable for request line skipped */
+bool Prewarmer::NextRow(std::string *uri) {
+  Reader::FieldIterator it, tail;
+  while (reader->Next(&it)) {
+    StringPiece fields[3];
+    size_t n(0);
+    for (; it != tail && n < arraysize(fields); ++it)
+      fields[n++] = (*it).trim(StringPieceFromLiteral(" \t"));
+
+    StringPiece const path = fields[0];
+    bool valid = !path.empty() && '/' == path[0];
+    for (StringPiece::const_iterator i = path.begin(); valid && i != path.end(); ++i)
+      valid = (unsigned char)*i > ' ' && *i != '?' && *i != '#' && *i != 0x7F;
+    unsigned int size[2] = { 0, 0 };
+    for (size_t k = 0; valid && k < 2; ++k) {
+      if (!fields[k + 1].empty())
+        valid = TryConvert(fields[k + 1], &size[k]);
+    }
+    if (!valid) {
+      ++skipped; // header line or malformed row
+      continue;
+    }
+
+    uri->assign(path.data(), path.size());
+    if (size[0] > 0 || size[1] > 0) {
+      char buf[0x30];
+      uri->append(buf, StringFormat(buf, "?w=%u&h=%u", size[0], size[1]));
+    }
+    ++rows;
+    return true;
+  }
+  return false;
+}
+
+void Prewarmer::StartSession(std::string const &uri) {
+  SessionPtr session(new Session(io_service));
+  session->uri = uri;
+  session->request = "GET " + uri + " HTTP/1.1\r\nHost: prewarm\r\nConnection: close\r\n\r\n";
+  ++in_flight;
+  session->socket.async_connect(endpoint,
+    strand.wrap(boost::bind(&Prewarmer::handle_connect, shared_from_this(), session,
+    boost::asio::placeholders::error)));
+}
+
+void Prewarmer::handle_connect(SessionPtr session, boost::system::error_code const &ec) {
+  if (!!ec) {
+    cpcl::Trace(CPCL_TRACE_LEVEL_WARNING, "Prewarmer::handle_connect(): %s", ec.message().c_str());
+    Complete(session, false);
+    return;
+  }
+  boost::asio::async_write(session->socket, boost::asio::buffer(session->request),
+    strand.wrap(boost::bind(&Prewarmer::handle_write, shared_from_this(), session,
+    boost::asio::placeholders::error)));
+}
+
+void Prewarmer::handle_write(SessionPtr session, boost::system::error_code const &ec) {
+  if (!!ec) {
+    Complete(session, false);
+    return;
+  }
+  session->socket.async_read_some(boost::asio::buffer(session->buffer),
+    strand.wrap(boost::bind(&Prewarmer::handle_read, shared_from_this(), session,
+    boost::asio::placeholders::error,
+    boost::asio::placeholders::bytes_transferred)));
+}
+
+/* body not needed, proxy caches it while sending; response complete when proxy closes connection */
+void Prewarmer::handle_read(SessionPtr session, boost::system::error_code const &ec, size_t bytes_transferred) {
+  if (session->head.size() < 12)
+    session->head.append(session->buffer.data(), (std::min)(bytes_transferred, 12 - session->head.size()));
+  if (!ec) {
+    session->socket.async_read_some(boost::asio::buffer(session->buffer),
+      strand.wrap(boost::bind(&Prewarmer::handle_read, shared_from_this(), session,
+      boost::asio::placeholders::error,
+      boost::asio::placeholders::bytes_transferred)));
+    return;
+  }
+  // "HTTP/1.1 200"
+  bool const ok = boost::asio::error::eof == ec && session->head.size() == 12
+    && StringPiece(session->head).substr(9) == StringPieceFromLiteral("200");
+  if (!ok)
+    cpcl::Trace(CPCL_TRACE_LEVEL_DEBUG, "Prewarmer::handle_read(): %s fails: \"%s\", %s",
+      session->uri.c_str(), session->head.c_str(), ec.message().c_str());
+  Complete(session, ok);
+}
+
+void Prewarmer::Complete(SessionPtr session, bool ok) {
+  boost::system::error_code ignored_ec;
+  session->socket.close(ignored_ec);
+  --in_flight;
+  if (ok)
+    ++done;
+  else
+    ++failed;
+  if (((done + failed) & 0xFF) == 0)
+    Progress("Complete");
+  Fill();
+}
+
+void Prewarmer::Finish() {
+  boost::system::error_code ignored_ec;
+  timer.cancel(ignored_ec);
+  reader.reset();
+  file.reset();
+  {
+    scoped_lock lock(mutex);
+    finished = pt::microsec_clock::universal_time();
+  }
+  Progress("Finish");
+  context->image_cache->State();
+  context->render_cache->State();
+  context->disk_cache->State();
+  running = false;
+}
+
+void Prewarmer::Progress(char const *method_name) {
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO, "Prewarmer::%s(): rows %lu, done %lu, failed %lu, skipped %lu, in flight %u",
+    method_name, rows.load(), done.load(), failed.load(), skipped.load(), (unsigned int)in_flight);
+}
+
+void Prewarmer::Report(cpcl::IOStream *out) {
+  std::string path;
+  unsigned int seconds(0);
+  {
+    scoped_lock lock(mutex);
+    path = csv_path;
+    if (!started.is_not_a_date_time())
+      seconds = (unsigned int)(((finished.is_not_a_date_time() ? pt::microsec_clock::universal_time() : finished) - started).total_seconds());
+  }
+  ImageCache::Stats const images = context->image_cache->GetStats(), renders = context->render_cache->GetStats();
+  DiskCache::Stats const disk = context->disk_cache->GetStats();
+  char buf[0x400];
+  size_t n = StringFormat(buf,
+    "{'state' : '%s', 'rows' : '%lu', 'done' : '%lu', 'failed' : '%lu', 'skipped' : '%lu', 'seconds' : '%u', "
+    "'image_cache_items' : '%u', 'image_cache_bytes' : '%u', 'render_cache_items' : '%u', 'render_cache_bytes' : '%u', "
+    "'disk_cache_items' : '%u', 'disk_cache_bytes' : '%llu', 'file' : '",
+    running ? (stop_requested ? "stopping" : "running") : "idle", rows.load(), done.load(), failed.load(), skipped.load(), seconds,
+    (unsigned int)images.items, (unsigned int)images.bytes, (unsigned int)renders.items, (unsigned int)renders.bytes,
+    (unsigned int)disk.items, (unsigned long long)disk.bytes);
+  out->Write(buf, (cpcl::uint32)n);
+  out->Write(path.data(), (cpcl::uint32)path.size());
+  out->Write("'}", 2);
+}
@@ -0,0 +1,101 @@
+﻿// prewarmer.h
+#pragma once
+
+#ifndef __PREWARMER_H
+#define __PREWARMER_H
+
+#include <string>
+#include <memory> // std::auto_ptr
+
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/atomic.hpp>
+#include <boost/array.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <cpcl/csv_reader.hpp>
+#include <cpcl/file_stream.h>
+
+struct ProxyContext;
+
+/*
+ * fills image_cache / render_cache (and disk cache) from CSV of "path,w,h" before clients ask for it
+ * w or h may be empty - not specified, header line and rows with path not starting with '/' skipped
+ * every row requested from the proxy itself over loopback with "Connection: close", response read to the end,
+ * so fetch, decode, render and caching are exactly the ones of live traffic, including single flights
+ * at most concurrency sessions in flight, sessions started at most rate per second(0 - not limited),
+ * so prewarm takes only part of webhdfs and render capacity
+ * CSV read lazily one row per started session, catalog of any size kept as file
+ * progress traced every 0x100 completed rows and at the end, together with cache footprint
+ * all handlers run in strand, Start and Report may be called from any thread
+ */
+class Prewarmer : public boost::enable_shared_from_this<Prewarmer>, private boost::noncopyable {
+public:
+  /* endpoint - listening endpoint of the proxy, unspecified address replaced by loopback */
+  Prewarmer(boost::asio::io_service &io_service, boost::asio::ip::tcp::endpoint endpoint, ProxyContext *context,
+    unsigned int concurrency, unsigned int rate);
+  ~Prewarmer();
+
+  /* returns 202 if started, 503 if job already running, 404 if csv_path can't be opened */
+  int Start(std::string const &csv_path);
+  /* sessions in flight complete, no new rows read */
+  void Stop();
+
+  /* progress and cache footprint json */
+  void Report(cpcl::IOStream *out);
+private:
+  typedef boost::asio::ip::tcp tcp;
+  typedef cpcl::CsvReader<0x1000> Reader;
+  struct Session {
+    tcp::socket socket;
+    std::string uri, request;
+    boost::array<char, 0x1000> buffer;
+    std::string head; // first bytes of response, status line
+    explicit Session(boost::asio::io_service &io_service) : socket(io_service)
+    {}
+  };
+  typedef boost::shared_ptr<Session> SessionPtr;
+
+  boost::asio::io_service &io_service;
+  boost::asio::io_service::strand strand;
+  tcp::endpoint endpoint;
+  ProxyContext *context; // owns prewarmer
+  size_t concurrency;
+  boost::posix_time::time_duration interval; // 1 / rate
+  boost::asio::deadline_timer timer;
+
+  // strand only
+  bool timer_armed;
+  unsigned int timer_generation; // of armed wait, completion of older wait(cancelled by Finish) ignored
+  boost::shared_ptr<cpcl::FileStream> file;
+  std::auto_ptr<Reader> reader;
+  bool reader_eof;
+  size_t in_flight;
+  boost::posix_time::ptime next_start;
+
+  boost::atomic<bool> running, stop_requested;
+  boost::atomic<unsigned long> rows, done, failed, skipped;
+  std::string csv_path;
+  boost::posix_time::ptime started, finished;
+  boost::mutex mutex; // csv_path, started, finished
+
+  void Begin(boost::shared_ptr<cpcl::FileStream> file);
+  void Fill();
+  bool NextRow(std::string *uri);
+  void StartSession(std::string const &uri);
+  void handle_connect(SessionPtr session, boost::system::error_code const &ec);
+  void handle_write(SessionPtr session, boost::system::error_code const &ec);
+  void handle_read(SessionPtr session, boost::system::error_code const &ec, size_t bytes_transferred);
+  void handle_timer(boost::system::error_code const &ec, unsigned int generation);
+  void Complete(SessionPtr session, bool ok);
+  void Finish();
+  void Progress(char const *method_name);
+};
+
+#endif // __PREWARMER_H
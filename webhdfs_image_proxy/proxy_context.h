@@ -0,0 +1,56 @@
+﻿// proxy_context.h
+#pragma once
+
+#ifndef __PROXY_CONTEXT_H
+#define __PROXY_CONTEXT_H
+
+#include <boost/shared_ptr.hpp>
+
+#include "options.h"
+#include "disk_cache.h"
+#include "dns_cache.h"
+#include "doc_cache.h"
+#include "image_cache.h"
+#include "metadata_cache.h"
+#include "prewarmer.h"
+#include "single_flight.h"
+#include "task_pool.h"
+#include "ttl_cache.hpp"
+#include "upstream_pool.h"
+
+// part of webhdfs GETFILESTATUS response used by proxy
+struct FileStatus {
+  cpcl::int64 length; // -1 - unknown
+  cpcl::int64 modification_time; // milliseconds since epoch
+
+  FileStatus() : length(-1), modification_time(0)
+  {}
+  bool operator!() const { return length < 0; }
+};
+
+// last datanode Location returned by namenode for op=OPEN, connection that fails on it erases it and asks namenode again
+typedef TtlCache<std::string> LocationCache;
+// modification time && length give response validators(ETag, Last-Modified) and version of cache keys,
+// so replaced file is not served from cache
+typedef TtlCache<FileStatus> StatusCache;
+
+// state shared by all connections of the Server
+struct ProxyContext {
+  Options options;
+  boost::shared_ptr<ImageCache> image_cache; // downloaded originals, keyed by webhdfs path
+  boost::shared_ptr<ImageCache> render_cache; // encoded response bodies, keyed by RenderKey - path && normalized query
+  boost::shared_ptr<DiskCache> disk_cache; // second tier of image_cache and render_cache, keys prefixed "original:" / "render:"
+  boost::shared_ptr<TaskPool> task_pool;
+  boost::shared_ptr<SingleFlight> fetches; // webhdfs downloads in progress, keyed by path
+  boost::shared_ptr<SingleFlight> renders; // responses in progress, keyed by RenderKey
+  boost::shared_ptr<SingleFlight> stats; // GETFILESTATUS in progress, keyed by webhdfs path, value - status json
+  boost::shared_ptr<UpstreamPool> upstream_pool; // idle keep-alive sockets to webhdfs hosts
+  boost::shared_ptr<DnsCache> dns_cache; // resolved webhdfs hosts
+  boost::shared_ptr<LocationCache> locations; // datanode Location for op=OPEN, keyed by webhdfs path
+  boost::shared_ptr<StatusCache> statuses; // GETFILESTATUS, keyed by webhdfs path
+  boost::shared_ptr<DocCache> docs; // loaded docs idle between renders, keyed like image_cache
+  boost::shared_ptr<Prewarmer> prewarmer; // CSV prewarm over loopback, /_admin/prewarm
+  boost::shared_ptr<MetadataCache> metadata; // page size && pixel format, keyed by hash of webhdfs path && version
+};
+
+#endif // __PROXY_CONTEXT_H
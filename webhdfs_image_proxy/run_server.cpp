@@ -2,13 +2,13 @@
 #include "server.h"
 #include <cpcl/trace.h>
 
-static net::Connection* ctor(boost::asio::io_service &io_service, boost::shared_ptr<ImageCache> image_cache, boost::shared_ptr<TaskPool> task_pool,
+static net::Connection* ctor(boost::asio::io_service &io_service, boost::shared_ptr<ProxyContext> context,
   std::string host, std::string port, plcl::PluginList *plugin_list) {
-  return new net::Connection(io_service, image_cache, task_pool, host, port, plugin_list);
+  return new net::Connection(io_service, context, host, port, plugin_list);
 }
 
 namespace ip = boost::asio::ip;
-void RunServer(std::string const &in_host, std::string const &in_port, std::string const &out_host, std::string const &out_port) {
+void RunServer(std::string const &in_host, std::string const &in_port, std::string const &out_host, std::string const &out_port, Options const &options) {
   std::auto_ptr<plcl::PluginList> plugin_list(plcl::PluginList::Create()); // Server::Run joins to all threads, so control must return only when all Connections deleted and PluginList not used
   if (!plugin_list.get()) {
     cpcl::Error(cpcl::StringPieceFromLiteral("RunServer(): no plugins loaded"));
@@ -28,7 +28,7 @@ void RunServer(std::string const &in_host, std::string const &in_port, std::stri
       endpoint = *endpoint_iterator;
     }
     
-    server.reset(new net::Server(endpoint, boost::bind(ctor, _1, _2, _3, out_host, out_port, plugin_list.get())));
+    server.reset(new net::Server(endpoint, boost::bind(ctor, _1, _2, out_host, out_port, plugin_list.get()), options));
     server->Run();
   } catch (boost::system::system_error const &e) {
     cpcl::Trace(CPCL_TRACE_LEVEL_ERROR,
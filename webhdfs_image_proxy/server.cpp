@@ -1,5 +1,6 @@
 ﻿#include <cpcl/basic.h>
 
+#include <algorithm> // std::min
 #include <vector>
 
 #include <boost/thread/thread.hpp>
@@ -33,14 +34,55 @@ namespace net {
 
 namespace ip = boost::asio::ip;
 
-Server::Server(ip::tcp::endpoint endpoint, Server::ConnectionCtor ctor)
-  : acceptor(io_service), image_cache(new ImageCache(0x100)), task_pool(new TaskPool()), ctor(ctor), stop(false) {
-  new_connection.reset(ctor(io_service, image_cache, task_pool));
+/* hot key of previous run read from disk cache, back to the memory cache it was saved from */
+static void Prefetch(ProxyContext *context, std::string const &key, cpcl::SharedBuffer const &v) {
+  cpcl::StringPiece const s(key);
+  if (s.starts_with(cpcl::StringPieceFromLiteral("render:")))
+    context->render_cache->Put(key.substr(7), v);
+  else if (s.starts_with(cpcl::StringPieceFromLiteral("original:")))
+    context->image_cache->Put(key.substr(9), v);
+}
+
+/* renders first, they answer requests as is, originals save fetch for sizes not rendered yet */
+static void SaveWarmKeys(ProxyContext *context) {
+  size_t const n = context->options.warm_keys;
+  if (!n)
+    return;
+  std::vector<std::string> renders, originals, keys;
+  context->render_cache->HotKeys(n, &renders);
+  context->image_cache->HotKeys(n - (std::min)(n, renders.size()), &originals);
+  keys.reserve(renders.size() + originals.size());
+  for (std::vector<std::string>::const_iterator it = renders.begin(); it != renders.end(); ++it)
+    keys.push_back("render:" + *it);
+  for (std::vector<std::string>::const_iterator it = originals.begin(); it != originals.end(); ++it)
+    keys.push_back("original:" + *it);
+  context->disk_cache->Save(keys);
+}
+
+Server::Server(ip::tcp::endpoint endpoint, Server::ConnectionCtor ctor, Options const &options)
+  : acceptor(io_service), context(new ProxyContext()), ctor(ctor), stop(false) {
+  context->options = options;
+  context->image_cache.reset(new ImageCache(options.image_cache_items, options.image_cache_bytes));
+  context->render_cache.reset(new ImageCache(options.render_cache_items, options.render_cache_bytes));
+  context->task_pool.reset(new TaskPool(options));
+  context->fetches.reset(new SingleFlight());
+  context->renders.reset(new SingleFlight());
+  context->stats.reset(new SingleFlight());
+  context->upstream_pool.reset(new UpstreamPool(options.upstream_idle_per_host, options.upstream_idle_timeout));
+  context->dns_cache.reset(new DnsCache(io_service, options.dns_ttl, options.dns_negative_ttl));
+  context->locations.reset(new LocationCache("LocationCache", options.location_ttl > 0 ? options.location_cache_items : 0, options.location_ttl));
+  context->statuses.reset(new StatusCache("StatusCache", options.status_ttl > 0 ? options.status_cache_items : 0, options.status_ttl));
+  context->metadata.reset(new MetadataCache(options.metadata_cache_items));
+  context->docs.reset(new DocCache(options.doc_cache_items, options.doc_cache_bytes));
+  context->disk_cache.reset(new DiskCache(options.disk_cache_dir, (cpcl::uint64)options.disk_cache_mb << 20, options.disk_cache_write_queue));
+  new_connection.reset(ctor(io_service, context));
 
   acceptor.open(endpoint.protocol());
   acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
   acceptor.bind(endpoint);
   acceptor.listen();
+  context->prewarmer.reset(new Prewarmer(io_service, acceptor.local_endpoint(), context.get(),
+    options.prewarm_concurrency, options.prewarm_rate));
   acceptor.async_accept(new_connection->Socket(),
     boost::bind(&Server::handle_accept, shared_from_this(), boost::asio::placeholders::error));
 }
@@ -48,7 +90,7 @@ Server::Server(ip::tcp::endpoint endpoint, Server::ConnectionCtor ctor)
 void Server::handle_accept(boost::system::error_code const &ec) {
   if (!ec) {
     new_connection->Start();
-    new_connection.reset(ctor(io_service, image_cache, task_pool));
+    new_connection.reset(ctor(io_service, context));
     acceptor.async_accept(new_connection->Socket(),
       boost::bind(&Server::handle_accept, shared_from_this(), boost::asio::placeholders::error));
   } else {
@@ -71,7 +113,8 @@ void Server::handle_signal(boost::system::error_code const &ec) {
 }
 
 void Server::Run() {
-  task_pool->Init(1);
+  context->task_pool->Init(context->options.render_threads);
+  context->disk_cache->Start(boost::bind(Prefetch, context.get(), _1, _2)); // index load and prefetch in background
 
   // Create a pool of threads to run all of the io_services.
   std::vector<boost::shared_ptr<boost::thread> > threads;
@@ -82,6 +125,9 @@ void Server::Run() {
     threads.push_back(thread);
   }
 
+  if (!context->options.prewarm_file.empty() && context->prewarmer->Start(context->options.prewarm_file) != 202)
+    cpcl::Trace(CPCL_TRACE_LEVEL_ERROR, "Server::Run(): unable to prewarm from %s", context->options.prewarm_file.c_str());
+
   boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
   signals.async_wait(boost::bind(&Server::handle_signal, shared_from_this(), boost::asio::placeholders::error));
 
@@ -91,8 +137,20 @@ void Server::Run() {
       signal_cv.wait(lock);
   }
   
-  task_pool->Stop(true);
+  context->prewarmer->Stop();
+  context->task_pool->Stop(true);
   io_service.stop();
+  context->disk_cache->Stop();
+  SaveWarmKeys(context.get());
+  context->image_cache->State();
+  context->render_cache->State();
+  context->disk_cache->State();
+  context->upstream_pool->State();
+  context->dns_cache->State();
+  context->locations->State();
+  context->statuses->State();
+  context->metadata->State();
+  context->docs->State();
   for (size_t i = 0; i < threads.size(); ++i) {
     if (threads[i]->joinable())
       threads[i]->join();
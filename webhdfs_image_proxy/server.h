@@ -8,6 +8,7 @@
 #include <boost/function.hpp>
 
 #include "connection.h"
+#include "proxy_context.h"
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
@@ -16,7 +17,7 @@ namespace net {
 
 class Server : public boost::enable_shared_from_this<Connection>, private boost::noncopyable {
 public:
-  typedef boost::function<Connection*(boost::asio::io_service&, boost::shared_ptr<ImageCache>, boost::shared_ptr<TaskPool>)> ConnectionCtor;
+  typedef boost::function<Connection*(boost::asio::io_service&, boost::shared_ptr<ProxyContext>)> ConnectionCtor;
 private:
   // Handle completion of an asynchronous accept operation.
   void handle_accept(boost::system::error_code const &ec);
@@ -30,8 +31,7 @@ private:
   // The next connection to be accepted.
   boost::shared_ptr<Connection> new_connection;
 
-  boost::shared_ptr<ImageCache> image_cache;
-  boost::shared_ptr<TaskPool> task_pool;
+  boost::shared_ptr<ProxyContext> context;
   ConnectionCtor ctor;
 
   boost::condition_variable signal_cv;
@@ -39,7 +39,7 @@ private:
   bool stop;
   void handle_signal(boost::system::error_code const &ec);
 public:
-  Server(boost::asio::ip::tcp::endpoint endpoint, ConnectionCtor ctor);
+  Server(boost::asio::ip::tcp::endpoint endpoint, ConnectionCtor ctor, Options const &options);
 
   // Run the server's io_service loop.
   void Run();
@@ -0,0 +1,55 @@
+﻿#include <cpcl/basic.h>
+
+#include <boost/thread/locks.hpp>
+
+#include <cpcl/trace.h>
+
+#include "single_flight.h"
+
+bool SingleFlight::Join(std::string const &k, Callback const &callback) {
+  scoped_lock lock(mutex);
+  std::pair<Flights::iterator, bool> it = flights.insert(Flights::value_type(k, Waiters()));
+  if (it.second)
+    return true;
+  it.first->second.push_back(callback);
+  return false;
+}
+
+size_t SingleFlight::Complete(std::string const &k, int status_code, cpcl::SharedBuffer const &v) {
+  Waiters waiters;
+  {
+    scoped_lock lock(mutex);
+    Flights::iterator it = flights.find(k);
+    if (it == flights.end()) {
+      cpcl::Trace(CPCL_TRACE_LEVEL_WARNING,
+        "SingleFlight::Complete(): no flight for \"%s\"",
+        k.c_str());
+      return 0;
+    }
+    waiters.swap(it->second);
+    flights.erase(it);
+  }
+  for (Waiters::iterator it = waiters.begin(), tail = waiters.end(); it != tail; ++it) {
+    try {
+      (*it)(status_code, v);
+    } catch (std::exception const &e) {
+      char const *s = e.what();
+      if (!!s)
+        cpcl::Trace(CPCL_TRACE_LEVEL_ERROR, "SingleFlight::Complete(): callback fails: exception: %s", s);
+      else
+        cpcl::Error(cpcl::StringPieceFromLiteral("SingleFlight::Complete(): callback fails: exception"));
+    }
+  }
+  if (!waiters.empty()) {
+    cpcl::Trace(CPCL_TRACE_LEVEL_DEBUG,
+      "SingleFlight::Complete(): \"%s\" status %d, %u waiters",
+      k.c_str(), status_code, (unsigned int)waiters.size());
+  }
+  return waiters.size();
+}
+
+size_t SingleFlight::WaitersCount(std::string const &k) {
+  scoped_lock lock(mutex);
+  Flights::const_iterator it = flights.find(k);
+  return (it == flights.end()) ? 0 : it->second.size();
+}
@@ -0,0 +1,46 @@
+﻿// single_flight.h
+#pragma once
+
+#ifndef __SINGLE_FLIGHT_H
+#define __SINGLE_FLIGHT_H
+
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cpcl/shared_buffer.h>
+
+/*
+ * in-flight deduplication of concurrent cache misses
+ * first Join for the key makes caller the leader, it must call Complete for the key exactly once
+ * later Join calls for the same key queue callbacks, invoked by Complete with leader result
+ * callbacks invoked on the thread that calls Complete, outside the lock
+ */
+class SingleFlight {
+public:
+  typedef boost::function<void(int, cpcl::SharedBuffer const&)> Callback;
+
+  SingleFlight()
+  {}
+
+  /* returns true if caller becomes leader, otherwise callback queued until leader completes */
+  bool Join(std::string const &k, Callback const &callback);
+  /* returns number of waiters notified */
+  size_t Complete(std::string const &k, int status_code, cpcl::SharedBuffer const &v);
+  /* number of callbacks queued for the key at the moment */
+  size_t WaitersCount(std::string const &k);
+private:
+  typedef std::vector<Callback> Waiters;
+  typedef boost::unordered_map<std::string, Waiters> Flights;
+  typedef boost::unique_lock<boost::mutex> scoped_lock;
+
+  Flights flights;
+  boost::mutex mutex;
+
+  DISALLOW_COPY_AND_ASSIGN(SingleFlight);
+};
+
+#endif // __SINGLE_FLIGHT_H
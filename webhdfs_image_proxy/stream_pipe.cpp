@@ -0,0 +1,115 @@
+﻿#include <cpcl/basic.h>
+
+#include <string.h> // memcpy
+#include <algorithm>
+
+#include <boost/thread/locks.hpp>
+
+#include <cpcl/trace.h>
+
+#include "stream_pipe.h"
+
+using cpcl::uint32;
+using cpcl::int64;
+
+StreamPipe::StreamPipe(size_t capacity, size_t tee_limit, boost::posix_time::ptime const &deadline, Notify const &notify)
+  : ring(new unsigned char[capacity]), capacity(capacity), head(0), used(0), closed(false), waiting(true), deadline(deadline),
+  notify(notify), tee_limit(tee_limit), tee_overflow(false), written(0)
+{}
+StreamPipe::~StreamPipe()
+{}
+
+void StreamPipe::Close() {
+  {
+    scoped_lock lock(mutex);
+    closed = true;
+  }
+  cv.notify_all();
+}
+
+bool StreamPipe::Closed() {
+  scoped_lock lock(mutex);
+  return closed;
+}
+
+cpcl::SharedBuffer StreamPipe::Tee() {
+  if (tee_overflow)
+    return cpcl::SharedBuffer();
+  return tee.Freeze();
+}
+
+cpcl::IOStream* StreamPipe::Clone() {
+  cpcl::Error(cpcl::StringPieceFromLiteral("StreamPipe::Clone(): not supported"));
+  return 0;
+}
+
+uint32 StreamPipe::Read(void *data, uint32 size) {
+  uint32 r(0);
+  {
+    scoped_lock lock(mutex);
+    while (r < size && used > 0) {
+      size_t const n = (std::min)((size_t)(size - r), (std::min)(used, capacity - head));
+      ::memcpy(static_cast<unsigned char*>(data) + r, ring.get() + head, n);
+      head = (head + n) % capacity;
+      used -= n;
+      r += (uint32)n;
+    }
+    if (!r)
+      waiting = true;
+  }
+  if (r > 0)
+    cv.notify_one();
+  return r;
+}
+
+uint32 StreamPipe::Write(void const *data, uint32 size) {
+  if (!tee_overflow) {
+    if (tee.Size() + size > (int64)tee_limit) {
+      tee_overflow = true;
+      tee.Freeze(); // release blocks
+    } else
+      tee.Write(data, size);
+  }
+  written += size;
+
+  uint32 r(0);
+  while (r < size) {
+    bool wake(false);
+    {
+      scoped_lock lock(mutex);
+      while (!closed && used == capacity) {
+        if (deadline.is_not_a_date_time())
+          cv.wait(lock);
+        else if (!cv.timed_wait(lock, deadline) && used == capacity) {
+          closed = true; // client stalled past request deadline
+          cpcl::Trace(CPCL_TRACE_LEVEL_WARNING, "StreamPipe::Write(): no free space before deadline, pipe closed");
+        }
+      }
+      if (closed)
+        return size; // nobody reads, but tee must be complete
+      size_t const tail = (head + used) % capacity;
+      size_t const n = (std::min)((size_t)(size - r), (std::min)(capacity - used, capacity - tail));
+      ::memcpy(ring.get() + tail, static_cast<unsigned char const*>(data) + r, n);
+      used += n;
+      r += (uint32)n;
+      wake = waiting;
+      waiting = false;
+    }
+    if (wake)
+      notify();
+  }
+  return r;
+}
+
+bool StreamPipe::Seek(int64, uint32, int64*) {
+  cpcl::Error(cpcl::StringPieceFromLiteral("StreamPipe::Seek(): not supported"));
+  return false;
+}
+
+int64 StreamPipe::Tell() {
+  return written;
+}
+
+int64 StreamPipe::Size() {
+  return written;
+}
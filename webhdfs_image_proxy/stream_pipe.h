@@ -0,0 +1,64 @@
+﻿// stream_pipe.h
+#pragma once
+
+#ifndef __STREAM_PIPE_H
+#define __STREAM_PIPE_H
+
+#include <boost/function.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <cpcl/io_stream.h>
+#include <cpcl/dynamic_memory_stream.h>
+#include <cpcl/shared_buffer.h>
+
+/*
+ * bounded byte pipe from render worker to client connection, so encoded jpeg sent while encoding continues
+ * Write(worker) copies bytes into ring buffer and blocks while it is full, so slow client slows down
+ * own render instead of growing memory, Read(connection) never blocks, returns 0 if ring is empty
+ * first Write after Read returned 0 calls notify, so connection neither polls nor gets a post per Write
+ * written bytes also kept in tee for render cache, tee dropped once it exceeds tee_limit
+ * Close(connection gone) wakes writer, after it Write only feeds tee
+ * Write waits for free space at most until deadline(request deadline), then closes pipe itself,
+ * worker notices expired cancel token at next scanline
+ */
+class StreamPipe : public cpcl::IOStream {
+public:
+  typedef boost::function<void()> Notify;
+
+  /* deadline not_a_date_time - Write waits until reader frees space or Close */
+  StreamPipe(size_t capacity, size_t tee_limit, boost::posix_time::ptime const &deadline, Notify const &notify);
+  virtual ~StreamPipe();
+
+  void Close();
+  bool Closed();
+  /* bytes written so far if all of them fit tee_limit, call after writer finished */
+  cpcl::SharedBuffer Tee();
+
+  virtual IOStream* Clone();
+  virtual cpcl::uint32 Read(void *data, cpcl::uint32 size);
+  virtual cpcl::uint32 Write(void const *data, cpcl::uint32 size);
+  virtual bool Seek(cpcl::int64 move_to, cpcl::uint32 move_method, cpcl::int64 *position);
+  virtual cpcl::int64 Tell();
+  virtual cpcl::int64 Size();
+private:
+  typedef boost::unique_lock<boost::mutex> scoped_lock;
+
+  boost::scoped_array<unsigned char> ring;
+  size_t capacity, head, used; // ring[head, head + used) modulo capacity
+  bool closed, waiting; // waiting - reader found ring empty, next Write notifies
+  boost::posix_time::ptime deadline;
+  Notify notify;
+  size_t tee_limit;
+  bool tee_overflow;
+  cpcl::DynamicMemoryStream tee; // touched only by writer
+  cpcl::int64 written;
+  boost::condition_variable cv; // signaled when reader frees space or pipe closed
+  boost::mutex mutex;
+
+  DISALLOW_COPY_AND_ASSIGN(StreamPipe);
+};
+
+#endif // __STREAM_PIPE_H
@@ -1,76 +1,293 @@
 ﻿#include <cpcl/basic.h>
 
+#include <string.h> // strcmp
+#include <algorithm>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
 #include "task_pool.h"
 #include "jpeg_rendering_device.h"
+#include "image_header.h"
 #include "connection.h"
+#include "stream_pipe.h"
 
+#include <cpcl/string_util.hpp>
 #include <cpcl/trace.h>
+#include <plcl/plugin_list.h>
+
+/* size and pixel format of the page before scaling */
+static ImageHeader PageHeader(boost::shared_ptr<plcl::Page> page) {
+  unsigned int pf[] = { PLCL_PIXEL_FORMAT_INVALID, PLCL_PIXEL_FORMAT_GRAY_8, PLCL_PIXEL_FORMAT_RGB_24, PLCL_PIXEL_FORMAT_BGR_24, PLCL_PIXEL_FORMAT_RGBA_32, PLCL_PIXEL_FORMAT_ARGB_32, PLCL_PIXEL_FORMAT_ABGR_32, PLCL_PIXEL_FORMAT_BGRA_32 };
+  unsigned int const page_pixfmt = page->GuessPixfmt();
+  unsigned int *it = std::lower_bound(pf, pf + arraysize(pf), page_pixfmt);
+  size_t i(0);
+  if (!(pf + arraysize(pf) == it || *it != page_pixfmt))
+    i = it - pf;
+  return ImageHeader(page->Width(), page->Height(), PixelFormatName((unsigned int)i));
+}
+
+static inline void FitPage(boost::shared_ptr<plcl::Page> page, unsigned int sw, unsigned int sh) {
+  page->Width(sw);
+  if (page->Height() > sh)
+    page->Height(sh);
+}
+
+TaskPool::TaskPool(Options const &options)
+  : next_worker(0), pending(0), idle_workers(0), steals(0), rejected(0), cancelled(0), expired(0),
+  queue_limit(options.render_queue_limit), wait_target(options.render_wait_target * 1000UL),
+  small_pixels(options.render_small_pixels), wait_average(0), exit_requested(false) {
+  handicaps[PRIORITY_INFO] = boost::posix_time::milliseconds(0);
+  handicaps[PRIORITY_SMALL] = boost::posix_time::milliseconds(options.render_aging / 4);
+  handicaps[PRIORITY_LARGE] = boost::posix_time::milliseconds(options.render_aging);
+}
 
 bool TaskPool::Init(int num_threads) {
-  if (!threads.empty() || num_threads < 1)
+  if (!threads.empty() || num_threads < 0)
     return false;
+  if (!num_threads)
+    num_threads = (std::max)(1, (int)boost::thread::hardware_concurrency());
 
+  workers.reserve(static_cast<size_t>(num_threads));
+  for (int i = 0; i < num_threads; ++i)
+    workers.push_back(boost::shared_ptr<Worker>(new Worker()));
   threads.reserve(static_cast<size_t>(num_threads));
   for (int i = 0; i < num_threads; ++i) {
-    boost::shared_ptr<boost::thread> thread(new boost::thread(boost::bind(&TaskPool::WorkerThread, this)));
+    boost::shared_ptr<boost::thread> thread(new boost::thread(boost::bind(&TaskPool::WorkerThread, this, (size_t)i)));
     threads.push_back(thread);
   }
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO, "TaskPool::Init(): %d workers", num_threads);
   return true;
 }
 
-void TaskPool::WorkerThread() {
-  bool exit(false);
-  while (!exit) {
+void TaskPool::WorkerThread(size_t i) {
+  while (!exit_requested) {
     TaskPool::Task task;
+    if (!NextTask(i, &task)) {
+      scoped_lock lock(idle_mutex);
+      ++idle_workers;
+      while (!pending && !exit_requested)
+        idle_cv.wait(lock);
+      --idle_workers;
+      continue;
+    }
+    UpdateWait(task);
     {
-      scoped_lock lock(tasks_mutex);
-      task = NextTask();
-      while (!task && !exit_requested) {
-        tasks_cv.wait(lock);
-        task = NextTask();
-      }
-      exit = exit_requested;
+      Worker &worker = *workers[i];
+      scoped_lock lock(worker.mutex);
+      worker.running = task.cancel_token;
+      worker.running_stream = task.stream;
     }
-    if (!!task && !exit) {
-      int status_code = 200;
-      try {
-        JpegRenderingDevice rendering_device(task.out);
-        task.page->Render(&rendering_device);
-      } catch (std::exception const &e) {
-        char const *s = e.what();
-        if (!!s)
-          cpcl::Trace(CPCL_TRACE_LEVEL_ERROR, "TaskPool::WorkerThread(): page->Render fails: exception: %s", s);
-        else
-          cpcl::Error(cpcl::StringPieceFromLiteral("TaskPool::WorkerThread(): page->Render fails: exception"));
-        status_code = 500;
-      }
-      {
-        scoped_lock lock(tasks_mutex);
-        exit = exit_requested;
+    if (exit_requested) { // Stop passed this worker before it took the task
+      task.cancel_token.Cancel();
+      if (!!task.stream)
+        task.stream->Close();
+    }
+
+    int status_code = 500;
+    try {
+      if (task.cancel_token.Cancelled())
+        throw cancelled_exception();
+      status_code = Process(task);
+    } catch (cancelled_exception const&) {
+      if (task.cancel_token.Expired()) {
+        ++expired;
+        status_code = 504;
+      } else {
+        ++cancelled;
+        status_code = 503;
       }
-      if (!exit)
-        task.connection->SendResponse(status_code);
+    } catch (std::exception const &e) {
+      char const *s = e.what();
+      if (!!s)
+        cpcl::Trace(CPCL_TRACE_LEVEL_ERROR, "TaskPool::WorkerThread(): Process fails: exception: %s", s);
+      else
+        cpcl::Error(cpcl::StringPieceFromLiteral("TaskPool::WorkerThread(): Process fails: exception"));
     }
+    {
+      Worker &worker = *workers[i];
+      scoped_lock lock(worker.mutex);
+      worker.running = CancelToken();
+      worker.running_stream.reset();
+    }
+    if (!exit_requested)
+      task.connection->RenderComplete(task.cancel_token, status_code);
   }
 }
 
-bool TaskPool::AddTask(boost::shared_ptr<net::Connection> connection, boost::shared_ptr<plcl::Page> page, boost::shared_ptr<cpcl::IOStream> out) {
-  if (threads.empty() || !connection || !page || !out)
+/* front with the least due time, caller holds mutex */
+bool TaskPool::Worker::Pop(Task *task) {
+  std::deque<Task> *r = 0;
+  for (size_t c = 0; c < PRIORITY_CLASSES; ++c) {
+    if (!tasks[c].empty() && (!r || tasks[c].front().due < r->front().due))
+      r = tasks + c;
+  }
+  if (!r)
     return false;
-  
-  scoped_lock lock(tasks_mutex);
-  tasks.push(TaskPool::Task(connection, page, out));
-  tasks_cv.notify_all();
+  *task = r->front();
+  r->pop_front();
   return true;
 }
 
-TaskPool::Task TaskPool::NextTask() {
-  TaskPool::Task r;
-  if (!tasks.empty()) {
-    r = tasks.front();
-    tasks.pop();
+void TaskPool::Worker::Clear() {
+  for (size_t c = 0; c < PRIORITY_CLASSES; ++c) {
+    std::deque<Task> tmp;
+    tmp.swap(tasks[c]);
+  }
+}
+
+/* own deques first, then deques of other workers */
+bool TaskPool::NextTask(size_t i, Task *task) {
+  {
+    Worker &worker = *workers[i];
+    scoped_lock lock(worker.mutex);
+    if (worker.Pop(task)) {
+      --pending;
+      return true;
+    }
+  }
+  for (size_t k = 1, n = workers.size(); k < n && !!pending; ++k) {
+    Worker &victim = *workers[(i + k) % n];
+    scoped_lock lock(victim.mutex, boost::try_to_lock);
+    if (!!lock && victim.Pop(task)) {
+      --pending;
+      ++steals;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * output pixels: with page size known computed the way Process scales the page,
+ * otherwise estimated from requested size, missing side taken equal to given one
+ */
+TaskPool::Priority TaskPool::PriorityOf(Task const &task) const {
+  if (task.json)
+    return PRIORITY_INFO;
+  unsigned long long w = task.width, h = task.height;
+  unsigned long long const pw = task.page_width, ph = task.page_height;
+  if (pw > 0 && ph > 0) {
+    if (!w && !h) {
+      w = pw;
+      h = ph;
+    } else if (!h) {
+      h = w * ph / pw;
+    } else if (!w) {
+      w = h * pw / ph;
+    } else if (w * ph / pw > h) { // FitPage: height bounded, width follows aspect
+      w = h * pw / ph;
+    } else {
+      h = w * ph / pw;
+    }
+  } else {
+    w = task.width ? task.width : task.height;
+    h = task.height ? task.height : task.width;
   }
-  return r;
+  if (!w || w * h > small_pixels)
+    return PRIORITY_LARGE;
+  return PRIORITY_SMALL;
+}
+
+/* original bytes the doc keeps alive + decoded page 0 */
+static size_t DocCost(cpcl::SharedBuffer const &original, ImageHeader const &header) {
+  unsigned int const bpp = (::strcmp(header.pf, "gray8") == 0) ? 1
+    : (::strcmp(header.pf, "rgb24") == 0 || ::strcmp(header.pf, "bgr24") == 0) ? 3 : 4;
+  return original.Size() + (size_t)header.width * header.height * bpp;
+}
+
+/*
+ * doc taken from doc cache or loaded from original, returned to cache after page rendered
+ * doc of render stopped by cancel_token not returned, its state after interrupted render unknown
+ */
+int TaskPool::Process(Task const &task) {
+  DocCache::Item item;
+  bool const cached = !!task.docs && task.docs->Acquire(task.doc_key, &item);
+  if (!cached) {
+    item.in.reset(new cpcl::SharedBufferStream(task.original));
+    item.doc = task.plugin_list->LoadDoc(item.in.get());
+    if (!item.doc) {
+      cpcl::Error(cpcl::StringPieceFromLiteral("TaskPool::Process(): unable to load document"));
+      return 500;
+    }
+  }
+  boost::shared_ptr<plcl::Page> page = item.doc->GetPage(0);
+  if (!page) {
+    cpcl::Error(cpcl::StringPieceFromLiteral("TaskPool::Process(): unable to get page 0 from document"));
+    return 500;
+  }
+  if (cached) {
+    if (page->Width() != item.page_width || page->Height() != item.page_height) {
+      page->Width(item.page_width);
+      page->Height(item.page_height);
+    }
+  } else {
+    item.page_width = page->Width();
+    item.page_height = page->Height();
+  }
+
+  ImageHeader const header = PageHeader(page);
+  if (!!task.metadata)
+    task.metadata->Put(task.metadata_key, header);
+
+  if (task.json) {
+    WriteImageInfo(header, task.out.get());
+  } else {
+    if (task.width > 0 && task.height > 0)
+      FitPage(page, task.width, task.height);
+    else if (!task.width && task.height > 0)
+      page->Height(task.height);
+    else if (task.width > 0 && !task.height)
+      page->Width(task.width);
+
+    JpegRenderingDevice rendering_device(task.out, task.cancel_token);
+    page->Render(&rendering_device);
+  }
+  if (!!task.docs) {
+    page.reset();
+    item.cost = DocCost(task.original, header);
+    task.docs->Release(task.doc_key, item);
+  }
+  return 200;
+}
+
+/* wait_average += (wait - wait_average) / 8 */
+void TaskPool::UpdateWait(Task const &task) {
+  long long const wait = (boost::posix_time::microsec_clock::universal_time() - task.queued).total_microseconds();
+  unsigned long const sample = (wait > 0) ? (unsigned long)wait : 0;
+  unsigned long v = wait_average.load(boost::memory_order_relaxed);
+  while (!wait_average.compare_exchange_weak(v, v - v / 8 + sample / 8, boost::memory_order_relaxed))
+  {}
+}
+
+int TaskPool::AddTask(Task const &task) {
+  if (threads.empty() || !task || exit_requested)
+    return 500;
+
+  size_t const queued = pending;
+  if ((queue_limit > 0 && queued >= queue_limit)
+    || (wait_target > 0 && queued >= workers.size() && wait_average > wait_target)) {
+    ++rejected;
+    cpcl::Trace(CPCL_TRACE_LEVEL_DEBUG,
+      "TaskPool::AddTask(): rejected, %u queued, wait average %lu us",
+      (unsigned int)queued, wait_average.load());
+    return 503;
+  }
+  
+  Task v(task);
+  Priority const priority = PriorityOf(task);
+  v.queued = boost::posix_time::microsec_clock::universal_time();
+  v.due = v.queued + handicaps[priority];
+  Worker &worker = *workers[next_worker++ % workers.size()];
+  {
+    scoped_lock lock(worker.mutex);
+    worker.tasks[priority].push_back(v);
+    ++pending; // under worker lock, so it never goes below zero
+  }
+  if (!!idle_workers) {
+    scoped_lock lock(idle_mutex);
+    idle_cv.notify_one();
+  }
+  return 202;
 }
 
 TaskPool::~TaskPool() {
@@ -82,13 +299,16 @@ void TaskPool::Stop(bool join) {
     return;
 
   {
-    scoped_lock lock(tasks_mutex);
-    if (!tasks.empty()) {
-      std::queue<Task> tmp;
-      tmp.swap(tasks);
-    }
+    scoped_lock lock(idle_mutex);
     exit_requested = true;
-    tasks_cv.notify_all();
+    idle_cv.notify_all();
+  }
+  for (Workers::iterator it = workers.begin(), tail = workers.end(); it != tail; ++it) {
+    scoped_lock lock((*it)->mutex);
+    (*it)->Clear();
+    (*it)->running.Cancel(); // stops between scanlines
+    if (!!(*it)->running_stream)
+      (*it)->running_stream->Close(); // wakes Write blocked by stalled client
   }
   if (join) {
     for (Threads::iterator it = threads.begin(), tail = threads.end(); it != tail; ++it) {
@@ -96,5 +316,7 @@ void TaskPool::Stop(bool join) {
         (*it)->join();
     }
     threads.clear();
+    cpcl::Trace(CPCL_TRACE_LEVEL_INFO, "TaskPool::Stop(): %lu steals, %lu rejected, %lu cancelled, %lu expired, wait average %lu us",
+      steals.load(), rejected.load(), cancelled.load(), expired.load(), wait_average.load());
   }
 }
@@ -4,9 +4,19 @@
 #ifndef __TASK_POOL_H
 #define __TASK_POOL_H
 
-#include <queue>
+#include <deque>
+#include <vector>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <cpcl/shared_buffer.h>
+
+#include "options.h"
+#include "cancel_token.h"
+#include "metadata_cache.h"
+#include "doc_cache.h"
 
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
@@ -16,44 +26,111 @@ namespace net {
 class Connection;
 }
 namespace plcl {
-class Page;
+class PluginList;
 }
 namespace cpcl {
 class IOStream;
 }
+class StreamPipe;
 
+/*
+ * worker threads run whole decode -> scale -> encode pipeline of the request:
+ * LoadDoc from original(or loaded doc taken from doc cache), GetPage(0), page size and pixel format put to metadata cache,
+ * then either page info json or scaled page rendered to jpeg
+ * result written to out, either memory stream or StreamPipe the connection drains to client while worker encodes,
+ * then connection->RenderComplete called from worker thread
+ * so io_service threads do only socket I/O
+ * cancelled task skipped or stopped between scanlines, connection gets 503,
+ * or 504 if request deadline passed while task waited in queue or rendered
+ *
+ * every worker has own deques under own mutex, AddTask spreads tasks round robin,
+ * worker takes task from own deques, when they are empty steals from others
+ *
+ * priority classes: page info, small output(render_small_pixels or less), large output(or original size)
+ * output size planned from cached page size when metadata known, otherwise estimated from requested size only
+ * each class is FIFO, next task is front with the least queued time + class handicap,
+ * handicap is 0 for info, render_aging / 4 for small and render_aging for large,
+ * so large render waits at most render_aging longer than it would in FIFO and can't starve
+ * idle workers sleep on one condition variable, AddTask takes its mutex and wakes one worker
+ * only when some worker is idle: producer increments pending then reads idle_workers,
+ * worker increments idle_workers then reads pending(both seq_cst), so at least one of them sees the other
+ *
+ * Stop cancels tasks in Process and closes their pipes, so workers blocked by stalled clients exit before join
+ *
+ * admission control: AddTask rejects task when queue_limit tasks already wait,
+ * or when tasks wait in queue and moving average of queue wait exceeds wait_target
+ */
 class TaskPool {
+public:
   struct Task {
     boost::shared_ptr<net::Connection> connection;
-    boost::shared_ptr<plcl::Page> page;
+    plcl::PluginList *plugin_list;
+    cpcl::SharedBuffer original; // encoded image, every task reads it through own stream
+    unsigned int width, height; // requested size, zero means "not specified"
+    bool json; // page info instead of image
+    boost::shared_ptr<MetadataCache> metadata; // gets page header of decoded original, may be empty
+    MetadataCache::Key metadata_key;
+    unsigned int page_width, page_height; // from metadata cache, zero - not known yet
+    boost::shared_ptr<DocCache> docs; // loaded docs of originals, may be empty
+    std::string doc_key; // same as image_cache key of original
     boost::shared_ptr<cpcl::IOStream> out;
+    boost::shared_ptr<StreamPipe> stream; // out when streamed to client, Stop closes it, so blocked Write returns
+    CancelToken cancel_token; // client gone or request deadline passed, result not needed
+    boost::posix_time::ptime queued; // set by AddTask
+    boost::posix_time::ptime due; // queued + handicap of priority class, set by AddTask
 
-    Task()
-    {}
-    Task(boost::shared_ptr<net::Connection> connection, boost::shared_ptr<plcl::Page> page, boost::shared_ptr<cpcl::IOStream> out)
-      : connection(connection), page(page), out(out)
+    Task() : plugin_list(0), width(0), height(0), json(false), metadata_key(0), page_width(0), page_height(0)
     {}
-    bool operator!() const { return !connection || !page || !out; }
+    bool operator!() const { return !connection || !plugin_list || !original || !out; }
   };
-  boost::condition_variable tasks_cv;
-  boost::mutex tasks_mutex;
+private:
   typedef boost::unique_lock<boost::mutex> scoped_lock;
   typedef std::vector<boost::shared_ptr<boost::thread> > Threads;
+  enum Priority {
+    PRIORITY_INFO, PRIORITY_SMALL, PRIORITY_LARGE,
+    PRIORITY_CLASSES
+  };
+  struct Worker {
+    std::deque<Task> tasks[PRIORITY_CLASSES];
+    CancelToken running; // token of task in Process, cancelled by Stop
+    boost::shared_ptr<StreamPipe> running_stream;
+    boost::mutex mutex;
+
+    bool Pop(Task *task);
+    void Clear();
+  };
+  typedef std::vector<boost::shared_ptr<Worker> > Workers;
 
   Threads threads;
-  std::queue<Task> tasks;
+  Workers workers;
+  boost::atomic<size_t> next_worker; // round robin for AddTask
+  boost::atomic<size_t> pending; // tasks in all deques
+  boost::atomic<size_t> idle_workers;
+  boost::atomic<unsigned long> steals, rejected, cancelled, expired;
+  size_t queue_limit;
+  unsigned long wait_target; // microseconds, 0 - not used
+  unsigned long long small_pixels;
+  boost::posix_time::time_duration handicaps[PRIORITY_CLASSES];
+  boost::atomic<unsigned long> wait_average; // microseconds, exponentially weighted
+  boost::condition_variable idle_cv;
+  boost::mutex idle_mutex;
 
-  bool exit_requested;
-  void WorkerThread();
-  Task NextTask();
+  boost::atomic<bool> exit_requested;
+  void WorkerThread(size_t i);
+  bool NextTask(size_t i, Task *task);
+  static int Process(Task const &task);
+  void UpdateWait(Task const &task);
+  Priority PriorityOf(Task const &task) const;
 public:
-  TaskPool() : exit_requested(false)
-  {}
+  /* render_queue_limit, render_wait_target, render_small_pixels, render_aging used */
+  explicit TaskPool(Options const &options);
   ~TaskPool();
 
+  /* num_threads == 0 - one worker per core */
   bool Init(int num_threads);
 
-  bool AddTask(boost::shared_ptr<net::Connection> connection, boost::shared_ptr<plcl::Page> page, boost::shared_ptr<cpcl::IOStream> out);
+  /* returns 202 if task queued, 503 if pool saturated, 500 if pool not running or task invalid */
+  int AddTask(Task const &task);
 
   void Stop(bool join = true);
 };
@@ -0,0 +1,175 @@
+﻿#include <cpcl/basic.h>
+
+#include <cassert>
+#include <map>
+#include <vector>
+#include <iostream>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cpcl/timer.h>
+#include <cpcl/string_util.hpp>
+#include <cpcl/dynamic_memory_stream.h>
+#include <cpcl/shared_buffer.h>
+
+#include "image_cache.h"
+
+using namespace cpcl;
+
+// ImageCache before sharding: one std::map behind one timed_mutex, lock timeout turns into miss
+struct SingleMutexCache {
+  typedef SharedBuffer Value;
+  typedef std::map<std::string, Value> Map;
+  typedef boost::unique_lock<boost::timed_mutex> scoped_lock;
+
+  Map map;
+  boost::timed_mutex mutex;
+
+  std::pair<Value, bool> Get(std::string const &k) {
+    Value item;
+    bool hit(false);
+    {
+      scoped_lock lock(mutex, boost::try_to_lock);
+      if (!!lock || lock.timed_lock(boost::posix_time::seconds(1))) {
+        Map::iterator i = map.find(k);
+        if (i != map.end()) {
+          item = (*i).second;
+          hit = true;
+        }
+      }
+    }
+    return std::make_pair(item, hit);
+  }
+  void Put(std::string const &k, Value v) {
+    scoped_lock lock(mutex);
+    map[k] = v;
+  }
+};
+
+static SharedBuffer MakeImage(size_t size) {
+  DynamicMemoryStream r;
+  std::vector<unsigned char> data(size, 0xCC);
+  r.Write(&data[0], (uint32)size);
+  return r.Freeze();
+}
+
+static std::vector<std::string> MakeKeys(size_t n) {
+  std::vector<std::string> r;
+  r.reserve(n);
+  for (size_t i = 0; i < n; ++i)
+    r.push_back(StringFormat("/user/images/%04u.jpg", (unsigned int)i));
+  return r;
+}
+
+void test_image_cache() {
+  { // items cap
+    ImageCache cache(3, 0x1000, 1);
+    std::vector<std::string> keys = MakeKeys(4);
+    for (size_t i = 0; i < 3; ++i)
+      cache.Put(keys[i], MakeImage(0x10));
+    assert(cache.Get(keys[0]).second); // keys[0] referenced, so it gets second chance
+    cache.Put(keys[3], MakeImage(0x10));
+    assert(cache.Get(keys[0]).second);
+    assert(!cache.Get(keys[1]).second);
+    assert(cache.Get(keys[2]).second);
+    assert(cache.Get(keys[3]).second);
+    ImageCache::Stats stats = cache.GetStats();
+    assert(3 == stats.items && 0x30 == stats.bytes && 1 == stats.evictions && 1 == stats.misses);
+  }
+  { // every item referenced, new item still admitted
+    ImageCache cache(3, 0x1000, 1);
+    std::vector<std::string> keys = MakeKeys(4);
+    for (size_t i = 0; i < 3; ++i)
+      cache.Put(keys[i], MakeImage(0x10));
+    for (size_t i = 0; i < 3; ++i)
+      assert(cache.Get(keys[i]).second);
+    cache.Put(keys[3], MakeImage(0x10));
+    assert(cache.Get(keys[3]).second);
+    assert(3 == cache.GetStats().items);
+  }
+  { // bytes cap
+    ImageCache cache(0x100, 0x100, 1);
+    std::vector<std::string> keys = MakeKeys(3);
+    cache.Put(keys[0], MakeImage(0x80));
+    cache.Put(keys[1], MakeImage(0x80));
+    cache.Put(keys[2], MakeImage(0x40));
+    assert(!cache.Get(keys[0]).second);
+    assert(cache.Get(keys[1]).second && cache.Get(keys[2]).second);
+    cache.Put(keys[0], MakeImage(0x101)); // larger than cache, ignored
+    assert(!cache.Get(keys[0]).second);
+    assert(0xC0 == cache.GetStats().bytes);
+  }
+  { // item larger than shard share borrows budget of other shards
+    ImageCache cache(0x100, 0x400, 4);
+    std::vector<std::string> keys = MakeKeys(0x11);
+    for (size_t i = 0; i < 0x10; ++i)
+      cache.Put(keys[i], MakeImage(0x40));
+    assert(0x400 == cache.GetStats().bytes);
+    cache.Put(keys[0x10], MakeImage(0x300));
+    assert(cache.Get(keys[0x10]).second);
+    ImageCache::Stats stats = cache.GetStats();
+    assert(stats.bytes <= 0x400 && stats.items >= 5);
+  }
+  { // replace
+    ImageCache cache(0x10, 0x100, 1);
+    std::string k("/a.png");
+    cache.Put(k, MakeImage(0x20));
+    cache.Put(k, MakeImage(0x40));
+    ImageCache::ItemHit r = cache.Get(k);
+    assert(r.second && 0x40 == r.first.Size());
+    assert(1 == cache.GetStats().items && 0x40 == cache.GetStats().bytes);
+  }
+}
+
+template<class Cache>
+static void HammerCache(Cache *cache, std::vector<std::string> const *keys, size_t iterations, size_t seed) {
+  size_t misses(0);
+  for (size_t i = 0; i < iterations; ++i) {
+    std::string const &k = (*keys)[(seed + i * 7) % keys->size()];
+    if (!cache->Get(k).second) {
+      cache->Put(k, MakeImage(0x10));
+      ++misses;
+    }
+  }
+  (void)misses;
+}
+
+template<class Cache>
+static double bench_cache_contention(Cache *cache, size_t threads_count, char const *name) {
+  std::vector<std::string> keys = MakeKeys(0x400);
+  size_t const iterations = 0x40000;
+  for (size_t i = 0; i < keys.size(); ++i)
+    cache->Put(keys[i], MakeImage(0x10));
+
+  timer t;
+  boost::thread_group threads;
+  for (size_t i = 0; i < threads_count; ++i)
+    threads.create_thread(boost::bind(&HammerCache<Cache>, cache, &keys, iterations, i * 0x101));
+  threads.join_all();
+  double r = t.elapsed();
+  std::cout.width(30);
+  std::cout << name << " : " << threads_count << " threads, " << std::fixed << r << "s, "
+    << (threads_count * iterations / r) << " ops/s" << std::endl;
+  return r;
+}
+
+void bench_image_cache() {
+  size_t threads_count = boost::thread::hardware_concurrency() * 2;
+  if (threads_count < 2)
+    threads_count = 2;
+  {
+    SingleMutexCache cache;
+    bench_cache_contention(&cache, threads_count, "single timed_mutex");
+  }
+  {
+    ImageCache cache(0x1000, 0x10000000, 1);
+    bench_cache_contention(&cache, threads_count, "ImageCache, 1 shard");
+  }
+  {
+    ImageCache cache(0x1000, 0x10000000);
+    bench_cache_contention(&cache, threads_count, "ImageCache, 16 shards");
+  }
+}
@@ -0,0 +1,81 @@
+﻿#include <cpcl/basic.h>
+
+#include <string.h> // strcmp, strstr
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include <cpcl/dynamic_memory_stream.h>
+#include <cpcl/shared_buffer.h>
+
+#include "image_header.h"
+
+using namespace cpcl;
+
+// signature + IHDR of width x height png
+static std::vector<unsigned char> MakePng(unsigned int width, unsigned int height, unsigned char bit_depth, unsigned char color_type) {
+  unsigned char const head[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n', 0, 0, 0, 13, 'I', 'H', 'D', 'R' };
+  std::vector<unsigned char> r(head, head + sizeof(head));
+  unsigned char const size[] = {
+    (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+    (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+    bit_depth, color_type, 0, 0, 0 };
+  r.insert(r.end(), size, size + sizeof(size));
+  return r;
+}
+
+// SOI + SOF0 of width x height jpeg with given number of components
+static std::vector<unsigned char> MakeJpeg(unsigned int width, unsigned int height, unsigned char components) {
+  unsigned char const data[] = { 0xFF, 0xD8, 0xFF, 0xC0, 0, (unsigned char)(8 + 3 * components), 8,
+    (unsigned char)(height >> 8), (unsigned char)height, (unsigned char)(width >> 8), (unsigned char)width, components };
+  std::vector<unsigned char> r(data, data + sizeof(data));
+  r.resize(r.size() + 3 * components, 0x11);
+  return r;
+}
+
+static ImageHeader Parse(std::vector<unsigned char> const &data) {
+  ImageHeader r;
+  size_t need;
+  bool const parsed = ParseImageHeader(&data[0], data.size(), &r, &need);
+  assert(parsed);
+  return r;
+}
+
+static std::string Info(ImageHeader const &header) {
+  DynamicMemoryStream out;
+  WriteImageInfo(header, &out);
+  SharedBuffer const v = out.Freeze();
+  std::string r(v.Size(), '\0');
+  r.resize(v.Read(0, &r[0], r.size()));
+  return r;
+}
+
+void test_image_header() {
+  { // rgb and rgba png
+    ImageHeader header = Parse(MakePng(640, 480, 8, 2));
+    assert(640 == header.width && 480 == header.height && ::strcmp(header.pf, "bgr24") == 0);
+    header = Parse(MakePng(640, 480, 8, 6));
+    assert(::strcmp(header.pf, "bgra32") == 0);
+  }
+  { // palette png: decoder may expand it to rgb or rgba, pf not reported
+    ImageHeader const header = Parse(MakePng(320, 200, 8, 3));
+    assert(320 == header.width && 200 == header.height && !PixelFormatIndex(header.pf));
+    std::string const info = Info(header);
+    assert(info == "{'width' : '320', 'height' : '200'}");
+  }
+  { // 16 bit rgb png
+    assert(!PixelFormatIndex(Parse(MakePng(1, 1, 16, 2)).pf));
+  }
+  { // gray and ycbcr jpeg
+    assert(::strcmp(Parse(MakeJpeg(100, 50, 1)).pf, "gray8") == 0);
+    ImageHeader const header = Parse(MakeJpeg(100, 50, 3));
+    assert(100 == header.width && 50 == header.height && ::strcmp(header.pf, "bgr24") == 0);
+    assert(Info(header) == "{'width' : '100', 'height' : '50', 'pf' : 'bgr24'}");
+  }
+  { // cmyk jpeg: 4 components, pf not reported
+    ImageHeader const header = Parse(MakeJpeg(100, 50, 4));
+    assert(100 == header.width && 50 == header.height && !PixelFormatIndex(header.pf));
+    assert(::strstr(Info(header).c_str(), "'pf'") == 0);
+  }
+}
@@ -0,0 +1,137 @@
+﻿// ttl_cache.hpp
+#pragma once
+
+#ifndef __TTL_CACHE_HPP
+#define __TTL_CACHE_HPP
+
+#include <string>
+#include <list>
+
+#include <boost/atomic.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <cpcl/basic.h>
+#include <cpcl/trace.h>
+
+/*
+ * small values of recently requested webhdfs paths(datanode Location, GETFILESTATUS), keyed by path
+ * entry valid for ttl, oldest Put dropped when items_cap reached, items_cap == 0 - cache disabled
+ * Erase drops entry that proved wrong(cached Location failed), counted as failure
+ * GetStale also returns expired entry, so caller may use it while it refreshes the entry
+ */
+template<class Value>
+class TtlCache {
+public:
+  /* name - prefix of State trace */
+  TtlCache(char const *name, size_t items_cap, unsigned int ttl)
+    : name(name), items_cap(items_cap), ttl(boost::posix_time::seconds(ttl)), hits(0), misses(0), failures(0)
+  {}
+
+  bool Get(std::string const &key, Value *v) {
+    boost::posix_time::ptime const now = boost::posix_time::microsec_clock::universal_time();
+    {
+      scoped_lock lock(mutex);
+      typename Entries::iterator it = entries.find(key);
+      if (it != entries.end()) {
+        if (now < it->second.expires) {
+          if (!!v)
+            *v = it->second.value;
+          ++hits;
+          return true;
+        }
+        order.erase(it->second.order);
+        entries.erase(it);
+      }
+    }
+    ++misses;
+    return false;
+  }
+
+  /* *fresh - entry within ttl, expired entry kept until Put refreshes it or items_cap drops it */
+  bool GetStale(std::string const &key, Value *v, bool *fresh) {
+    boost::posix_time::ptime const now = boost::posix_time::microsec_clock::universal_time();
+    bool found(false);
+    *fresh = false;
+    {
+      scoped_lock lock(mutex);
+      typename Entries::iterator it = entries.find(key);
+      if (it != entries.end()) {
+        found = true;
+        *fresh = now < it->second.expires;
+        if (!!v)
+          *v = it->second.value;
+      }
+    }
+    if (*fresh)
+      ++hits;
+    else
+      ++misses;
+    return found;
+  }
+
+  void Put(std::string const &key, Value const &v) {
+    if (!items_cap)
+      return;
+    boost::posix_time::ptime const expires = boost::posix_time::microsec_clock::universal_time() + ttl;
+    scoped_lock lock(mutex);
+    std::pair<typename Entries::iterator, bool> it = entries.insert(typename Entries::value_type(key, Entry()));
+    Entry &entry = it.first->second;
+    if (it.second) {
+      entry.order = order.insert(order.end(), key);
+    } else {
+      order.splice(order.end(), order, entry.order);
+    }
+    entry.value = v;
+    entry.expires = expires;
+
+    while (entries.size() > items_cap) {
+      entries.erase(order.front());
+      order.pop_front();
+    }
+  }
+
+  void Erase(std::string const &key) {
+    ++failures;
+    scoped_lock lock(mutex);
+    typename Entries::iterator it = entries.find(key);
+    if (it != entries.end()) {
+      order.erase(it->second.order);
+      entries.erase(it);
+    }
+  }
+
+  void State() {
+    size_t n;
+    {
+      scoped_lock lock(mutex);
+      n = entries.size();
+    }
+    cpcl::Trace(CPCL_TRACE_LEVEL_INFO,
+      "%s::State(): items %u/%u, hits %lu, misses %lu, failures %lu",
+      name, (unsigned int)n, (unsigned int)items_cap, hits.load(), misses.load(), failures.load());
+  }
+private:
+  typedef std::list<std::string> Order; // front - oldest Put
+  struct Entry {
+    Value value;
+    boost::posix_time::ptime expires;
+    Order::iterator order;
+  };
+  typedef boost::unordered_map<std::string, Entry> Entries;
+  typedef boost::unique_lock<boost::mutex> scoped_lock;
+
+  char const *name;
+  Entries entries;
+  Order order;
+  size_t items_cap;
+  boost::posix_time::time_duration ttl;
+  boost::atomic<unsigned long> hits, misses, failures;
+  boost::mutex mutex;
+
+  DISALLOW_COPY_AND_ASSIGN(TtlCache);
+};
+
+#endif // __TTL_CACHE_HPP
@@ -0,0 +1,126 @@
+﻿#include <cpcl/basic.h>
+
+#include <boost/thread/locks.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cpcl/trace.h>
+
+#include "upstream_pool.h"
+
+namespace ip = boost::asio::ip;
+namespace pt = boost::posix_time;
+
+static inline void CloseSocket(ip::tcp::socket &socket) {
+  boost::system::error_code ignored_ec;
+  socket.shutdown(ip::tcp::socket::shutdown_both, ignored_ec);
+  ignored_ec = boost::system::error_code();
+  socket.close(ignored_ec);
+}
+
+/*
+ * idle socket must have nothing to read: readable socket either closed by peer(eof, reset)
+ * or contains unexpected data, in both cases it can't be used for next request
+ */
+static bool Alive(ip::tcp::socket &socket) {
+  if (!socket.is_open())
+    return false;
+  boost::system::error_code ec, ignored_ec;
+  socket.non_blocking(true, ec);
+  if (ec)
+    return false;
+  unsigned char c;
+  socket.read_some(boost::asio::buffer(&c, 1), ec);
+  socket.non_blocking(false, ignored_ec);
+  return boost::asio::error::would_block == ec || boost::asio::error::try_again == ec;
+}
+
+UpstreamPool::UpstreamPool(size_t idle_per_host, unsigned int idle_timeout)
+  : idle_per_host(idle_per_host), idle_timeout(pt::seconds(idle_timeout)),
+  reused(0), misses(0), expired(0), broken(0), overflows(0)
+{}
+
+std::string UpstreamPool::Key(std::string const &host, std::string const &port) {
+  return host + ":" + port;
+}
+
+size_t UpstreamPool::DropExpired(Sockets &sockets, pt::ptime const &now) {
+  size_t n(0);
+  while (!sockets.empty() && now - sockets.front().since > idle_timeout) {
+    CloseSocket(*sockets.front().socket);
+    sockets.pop_front();
+    ++n;
+  }
+  return n;
+}
+
+UpstreamPool::Socket UpstreamPool::Acquire(std::string const &host, std::string const &port) {
+  pt::ptime const now = pt::microsec_clock::universal_time();
+  std::string const k = Key(host, port);
+  Socket r;
+  {
+    scoped_lock lock(mutex);
+    Hosts::iterator it = hosts.find(k);
+    if (it != hosts.end()) {
+      Sockets &sockets = it->second;
+      expired += DropExpired(sockets, now);
+      while (!sockets.empty()) {
+        Socket socket = sockets.back().socket;
+        sockets.pop_back();
+        if (Alive(*socket)) {
+          r = socket;
+          break;
+        }
+        CloseSocket(*socket);
+        ++broken;
+      }
+    }
+  }
+  if (r)
+    ++reused;
+  else
+    ++misses;
+  return r;
+}
+
+void UpstreamPool::Release(std::string const &host, std::string const &port, Socket socket) {
+  if (!socket || !socket->is_open())
+    return;
+  if (!idle_per_host) {
+    CloseSocket(*socket);
+    return;
+  }
+
+  pt::ptime const now = pt::microsec_clock::universal_time();
+  Idle v;
+  v.socket = socket;
+  v.since = now;
+  Socket overflow;
+  {
+    scoped_lock lock(mutex);
+    Sockets &sockets = hosts[Key(host, port)];
+    expired += DropExpired(sockets, now);
+    if (sockets.size() >= idle_per_host) {
+      overflow = sockets.front().socket; // oldest
+      sockets.pop_front();
+    }
+    sockets.push_back(v);
+  }
+  if (overflow) {
+    CloseSocket(*overflow);
+    ++overflows;
+  }
+}
+
+void UpstreamPool::State() {
+  size_t hosts_count, idle(0);
+  {
+    scoped_lock lock(mutex);
+    hosts_count = hosts.size();
+    for (Hosts::const_iterator it = hosts.begin(), tail = hosts.end(); it != tail; ++it)
+      idle += it->second.size();
+  }
+  cpcl::Trace(CPCL_TRACE_LEVEL_INFO,
+    "UpstreamPool::State(): %u hosts, idle %u, reused %lu, misses %lu, expired %lu, broken %lu, overflows %lu",
+    (unsigned int)hosts_count, (unsigned int)idle,
+    reused.load(), misses.load(), expired.load(), broken.load(), overflows.load());
+}
@@ -0,0 +1,56 @@
+﻿// upstream_pool.h
+#pragma once
+
+#ifndef __UPSTREAM_POOL_H
+#define __UPSTREAM_POOL_H
+
+#include <string>
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+/*
+ * idle keep-alive sockets to webhdfs hosts(namenode and datanodes), shared by all connections
+ * sockets keyed by "host:port" as it written in request / Location header, most recently released socket reused first
+ * socket idle longer than idle_timeout or found closed by peer(health check on Acquire) is dropped
+ * at most idle_per_host sockets kept for each host, extra released sockets closed
+ */
+class UpstreamPool {
+public:
+  typedef boost::shared_ptr<boost::asio::ip::tcp::socket> Socket;
+
+  UpstreamPool(size_t idle_per_host, unsigned int idle_timeout);
+
+  /* returns connected idle socket for host:port, or empty pointer if there is none */
+  Socket Acquire(std::string const &host, std::string const &port);
+  /* socket must be connected and have no unread response, ownership passes to pool */
+  void Release(std::string const &host, std::string const &port, Socket socket);
+
+  void State();
+private:
+  struct Idle {
+    Socket socket;
+    boost::posix_time::ptime since;
+  };
+  typedef std::deque<Idle> Sockets; // back - most recently released
+  typedef boost::unordered_map<std::string, Sockets> Hosts;
+  typedef boost::unique_lock<boost::mutex> scoped_lock;
+
+  Hosts hosts;
+  size_t idle_per_host;
+  boost::posix_time::time_duration idle_timeout;
+  boost::atomic<unsigned long> reused, misses, expired, broken, overflows;
+  boost::mutex mutex;
+
+  static std::string Key(std::string const &host, std::string const &port);
+  size_t DropExpired(Sockets &sockets, boost::posix_time::ptime const &now);
+
+  DISALLOW_COPY_AND_ASSIGN(UpstreamPool);
+};
+
+#endif // __UPSTREAM_POOL_H